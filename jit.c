@@ -22,13 +22,53 @@
 #include <stdint.h>
 #include <string.h>
 #include <assert.h>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#if defined(__x86_64__) && !defined(_WIN32)
+#include <cpuid.h>
+#endif
 #include "jit.h"
 
+#define JIT_MAXLABELS 16
+#define JIT_MAXFIXUPS 32
+#define JIT_MAXPOOLREFS 64
+
 struct jit {
     uint8_t *page;
     uint8_t *cur;
+    uint8_t *end;
+    // The arena the code goes to, NULL if the jit has its own page.
+    struct jit_arena *arena;
+    // Labels are offsets into the page, -1 if not bound yet.
+    int nlabel;
+    int label[JIT_MAXLABELS];
+    // Forward branches, to be resolved when the label gets bound.
+    int nfixup;
+    struct { int label, pos; } fixup[JIT_MAXFIXUPS];
+    // The size of the stack frame below the saved registers.
+    int frame;
+    // Vector lanes, 0 if vector instructions are not used.
+    int vlanes;
+    // RIP-relative references to the constant pool (the BSWAP mask),
+    // which is placed after the code.
+    int npoolref;
+    int poolref[JIT_MAXPOOLREFS];
+    // The offset of the pool, once placed, or -1.
+    int pool;
+    // Patchable rotations: slots large enough for either
+    // the rotation or BSWAP, see jins_ROTLp().
+    int npatch, maxpatch;
+    struct { int pos, size, vec, reg, imm8; } *patch;
+    // For perf, see jit_name().
+    char *name;
+    // The scalar extensions to use, see jit_isa().
+    int isa;
 };
 
 enum R86_e {
@@ -36,8 +76,16 @@ enum R86_e {
     R8, R9, R10, R11, R12, R13, R14, R15,
 };
 
+// Every instruction makes sure there is room for it first; the code
+// buffer grows (and possibly moves) as needed.  The longest instruction
+// is 15 bytes.
+static void jit_grow(struct jit *jit, size_t n);
+#define JIT_ROOM(jit, n) do { if ((size_t)((jit)->end - (jit)->cur) < (n)) jit_grow(jit, n); } while (0)
+#define JIT_INSN_MAX 16
+
 static void jins86_PUSH(struct jit *jit, enum R86_e reg)
 {
+    JIT_ROOM(jit, JIT_INSN_MAX);
     *jit->cur = 0x41;
     jit->cur += (reg >= R8);
     *jit->cur++ = 0x50 + (reg & 7);
@@ -45,6 +93,7 @@ static void jins86_PUSH(struct jit *jit, enum R86_e reg)
 
 static void jins86_POP(struct jit *jit, enum R86_e reg)
 {
+    JIT_ROOM(jit, JIT_INSN_MAX);
     *jit->cur = 0x41;
     jit->cur += (reg >= R8);
     *jit->cur++ = 0x58 + (reg & 7);
@@ -80,26 +129,50 @@ static void jins_restoreRegs(struct jit *jit)
 
 static void jins_RET(struct jit *jit)
 {
+    JIT_ROOM(jit, JIT_INSN_MAX);
     *jit->cur++ = 0xc3;
 }
 
 static long pagesize;
 
-struct jit *jit_new(void)
+static void jit_init(struct jit *jit)
 {
-    struct jit *jit = malloc(sizeof *jit);
-    assert(jit);
+    jit->cur = jit->page;
+    jit->nlabel = 0;
+    jit->nfixup = 0;
+    jit->frame = 0;
+    jit->vlanes = 0;
+    jit->npoolref = 0;
+    jit->pool = -1;
+    jit->npatch = 0;
+    jit->maxpatch = 0;
+    jit->patch = NULL;
+    jit->name = NULL;
+    jit->isa = jit_isa();
+
+    jins_saveRegs(jit);
+}
 
+static void jit_pagesize(void)
+{
     if (pagesize == 0) {
 	pagesize = sysconf(_SC_PAGESIZE);
 	assert(pagesize >= 4096);
     }
+}
+
+struct jit *jit_new(void)
+{
+    struct jit *jit = malloc(sizeof *jit);
+    assert(jit);
 
+    jit_pagesize();
     jit->page = mmap(NULL, pagesize, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
     assert(jit->page != NULL && jit->page != MAP_FAILED);
-    jit->cur = jit->page;
+    jit->end = jit->page + pagesize;
+    jit->arena = NULL;
 
-    jins_saveRegs(jit);
+    jit_init(jit);
     return jit;
 }
 
@@ -107,22 +180,216 @@ void jit_free(struct jit *jit)
 {
     if (!jit)
 	return;
-    int rc = munmap(jit->page, pagesize);
-    assert(rc == 0);
+    if (!jit->arena) {
+	int rc = munmap(jit->page, jit->end - jit->page);
+	assert(rc == 0);
+    }
+    free(jit->patch);
+    free(jit->name);
     free(jit);
 } 
 
+static void jins_VZEROUPPER(struct jit *jit);
+static void jins86_OPri(struct jit *jit, int mod, enum R86_e reg, int imm32);
+static void jit_emitPool(struct jit *jit);
+static void jit_arena_done(struct jit_arena *arena, struct jit *jit);
+static void jit_perf_load(struct jit *jit);
+
+void jit_frame(struct jit *jit, int size)
+{
+    assert(jit->frame == 0);
+    assert(size > 0);
+    jit->frame = (size + 15) & ~15;
+    jins86_OPri(jit, 5, RSP, jit->frame);  // SUB RSP, frame
+}
+
 void *jit_compile(struct jit *jit)
 {
+    assert(jit->nfixup == 0);
+    if (jit->frame)
+	jins86_OPri(jit, 0, RSP, jit->frame);  // ADD RSP, frame
+    if (jit->vlanes)
+	jins_VZEROUPPER(jit);
     jins_restoreRegs(jit);
     jins_RET(jit);
+    jit_emitPool(jit);
+    jit_perf_load(jit);
 
-    int rc = mprotect(jit->page, pagesize, PROT_READ | PROT_EXEC);
-    assert(rc == 0);
+    if (jit->arena) {
+	jit_arena_done(jit->arena, jit);
+	return jit->page;
+    }
 
+    jit_protect(jit);
     return jit->page;
 }
 
+void jit_unprotect(struct jit *jit)
+{
+    assert(!jit->arena);
+    int rc = mprotect(jit->page, jit->end - jit->page, PROT_READ | PROT_WRITE);
+    assert(rc == 0);
+}
+
+void jit_protect(struct jit *jit)
+{
+    assert(!jit->arena);
+    int rc = mprotect(jit->page, jit->end - jit->page, PROT_READ | PROT_EXEC);
+    assert(rc == 0);
+}
+
+// Functions are packed into chunks and aligned on cache lines.
+// A new function starts in a new chunk unless a page is left in
+// the current one; a function that outgrows its chunk is moved to
+// a larger one.
+#define ARENA_CHUNK_PAGES 64
+#define ARENA_ALIGN 64
+
+struct jit_arena {
+    size_t chunksize;
+    int nchunk;
+    struct { uint8_t *base; size_t size; } *chunk;
+    int cur;       // the chunk being filled
+    size_t used;   // how much of it is used
+    int open;      // a function is being added
+    int sealed;
+};
+
+struct jit_arena *jit_arena_new(void)
+{
+    struct jit_arena *arena = malloc(sizeof *arena);
+    assert(arena);
+    jit_pagesize();
+    arena->chunksize = ARENA_CHUNK_PAGES * pagesize;
+    arena->nchunk = 0;
+    arena->chunk = NULL;
+    arena->cur = -1;
+    arena->used = 0;
+    arena->open = 0;
+    arena->sealed = 0;
+    return arena;
+}
+
+void jit_arena_free(struct jit_arena *arena)
+{
+    if (!arena)
+	return;
+    for (int i = 0; i < arena->nchunk; i++) {
+	int rc = munmap(arena->chunk[i].base, arena->chunk[i].size);
+	assert(rc == 0);
+    }
+    free(arena->chunk);
+    free(arena);
+}
+
+// Switch to the next chunk, which must be at least size bytes;
+// a chunk left over from before the reset is reused if it is large enough.
+static void jit_arena_next(struct jit_arena *arena, size_t size)
+{
+    int next = arena->cur + 1;
+    if (next == arena->nchunk || arena->chunk[next].size < size) {
+	arena->chunk = realloc(arena->chunk, (arena->nchunk + 1) * sizeof *arena->chunk);
+	assert(arena->chunk);
+	memmove(arena->chunk + next + 1, arena->chunk + next, (arena->nchunk - next) * sizeof *arena->chunk);
+	arena->nchunk++;
+	uint8_t *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	assert(base != NULL && base != MAP_FAILED);
+	arena->chunk[next].base = base;
+	arena->chunk[next].size = size;
+    }
+    arena->cur = next;
+    arena->used = 0;
+}
+
+struct jit *jit_new_arena(struct jit_arena *arena)
+{
+    assert(!arena->open);
+    assert(!arena->sealed);
+
+    if (arena->cur < 0 || arena->chunk[arena->cur].size - arena->used < (size_t) pagesize)
+	jit_arena_next(arena, arena->chunksize);
+
+    struct jit *jit = malloc(sizeof *jit);
+    assert(jit);
+    jit->page = arena->chunk[arena->cur].base + arena->used;
+    jit->end = arena->chunk[arena->cur].base + arena->chunk[arena->cur].size;
+    jit->arena = arena;
+    arena->open = 1;
+
+    jit_init(jit);
+    return jit;
+}
+
+static void jit_arena_done(struct jit_arena *arena, struct jit *jit)
+{
+    assert(arena->open);
+    size_t size = jit->cur - jit->page;
+    arena->used += (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    arena->open = 0;
+}
+
+static void jit_grow(struct jit *jit, size_t n)
+{
+    size_t used = jit->cur - jit->page;
+    size_t size = jit->end - jit->page;
+    while (size < used + n)
+	size *= 2;
+
+    uint8_t *page;
+    if (jit->arena) {
+	// The function gets a chunk of its own; all offsets
+	// are relative to its start, so it can be moved.
+	struct jit_arena *arena = jit->arena;
+	jit_arena_next(arena, (size + pagesize - 1) / pagesize * pagesize);
+	page = arena->chunk[arena->cur].base;
+	size = arena->chunk[arena->cur].size;
+	memcpy(page, jit->page, used);
+    }
+    else {
+	page = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	assert(page != NULL && page != MAP_FAILED);
+	memcpy(page, jit->page, used);
+	int rc = munmap(jit->page, jit->end - jit->page);
+	assert(rc == 0);
+    }
+    jit->page = page;
+    jit->cur = page + used;
+    jit->end = page + size;
+}
+
+static void jit_arena_protect(struct jit_arena *arena, int prot)
+{
+    for (int i = 0; i <= arena->cur; i++) {
+	int rc = mprotect(arena->chunk[i].base, arena->chunk[i].size, prot);
+	assert(rc == 0);
+    }
+}
+
+void jit_arena_seal(struct jit_arena *arena)
+{
+    assert(!arena->open);
+    assert(!arena->sealed);
+    jit_arena_protect(arena, PROT_READ | PROT_EXEC);
+    arena->sealed = 1;
+}
+
+void jit_arena_unseal(struct jit_arena *arena)
+{
+    assert(arena->sealed);
+    jit_arena_protect(arena, PROT_READ | PROT_WRITE);
+    arena->sealed = 0;
+}
+
+void jit_arena_reset(struct jit_arena *arena)
+{
+    assert(!arena->open);
+    if (arena->sealed)
+	jit_arena_protect(arena, PROT_READ | PROT_WRITE);
+    arena->sealed = 0;
+    arena->cur = -1;
+    arena->used = 0;
+}
+
 static const uint8_t JRto86map[] = {
     RAX, RBX, RBP,
 #if defined(_WIN32) || defined(__CYGWIN__)
@@ -133,12 +400,16 @@ static const uint8_t JRto86map[] = {
     R10, R11, R12, R13, R14, R15,
     R9, R8, RCX, RDX, RSI, RDI,
 #endif
+    RSP,
 };
 
-#define JRto86(reg) (assert(reg >= 0 && reg < sizeof JRto86map), JRto86map[reg])
+// JR_SP can only be used as a base register.
+#define JRto86(reg) (assert(reg >= 0 && reg < JR_SP), JRto86map[reg])
+#define JRto86mem(reg) (assert(reg >= 0 && reg <= JR_SP), JRto86map[reg])
 
 static void jins86_OPrr(struct jit *jit, int op, enum R86_e dst, enum R86_e src)
 {
+    JIT_ROOM(jit, JIT_INSN_MAX);
     int rex = 0x48;           // REX.W
     rex |= (src >= R8) << 2;  // REX.R
     rex |= (dst >= R8) << 0;  // REX.B
@@ -160,6 +431,7 @@ void jins_XOR(struct jit *jit, enum JR_e dst, enum JR_e src) { OPrr(0x31); }
 
 static void jins86_OPrs(struct jit *jit, int mod, enum R86_e reg, int imm8)
 {
+    JIT_ROOM(jit, JIT_INSN_MAX);
     int rex = 0x48;
     rex |= (reg >= 8);
     *jit->cur++ = rex;
@@ -182,6 +454,7 @@ void jins_ROTR(struct jit *jit, enum JR_e reg, int imm8) { OPrs(1); }
 
 static void jins86_OPr(struct jit *jit, int op, int modrm, enum JR_e reg)
 {
+    JIT_ROOM(jit, JIT_INSN_MAX);
     int rex = 0x48;
     rex |= (reg >= 8);
     *jit->cur++ = rex;
@@ -195,30 +468,734 @@ static void jins86_OPr(struct jit *jit, int op, int modrm, enum JR_e reg)
 
 void jins_BSWAP(struct jit *jit, enum JR_e reg) { OPr(0x0f, 0xc8); }
 
-static void jins86_OPrm(struct jit *jit, int op, enum R86_e reg, enum R86_e mem, int disp8)
+// ModRM (and SIB) for a [base + disp] operand, with disp8 or disp32.
+// With EVEX, disp8 is implicitly multiplied by the scale.
+static void jins86_mem(struct jit *jit, int reg, enum R86_e base, int disp, int scale)
 {
+    int mod = 2;
+    if (disp == 0 && (base & 7) != RBP)
+	mod = 0;
+    else if (disp % scale == 0 && disp / scale >= -128 && disp / scale < 128)
+	mod = 1;
+    int modrm = (mod << 6);
+    modrm |= (reg & 7) << 3;
+    modrm |= (base & 7);
+    *jit->cur++ = modrm;
+    if ((base & 7) == RSP)
+	*jit->cur++ = 0x24;       // SIB: no index
+    if (mod == 1)
+	*jit->cur++ = disp / scale;
+    else if (mod == 2) {
+	int32_t disp32 = disp;
+	memcpy(jit->cur, &disp32, 4);
+	jit->cur += 4;
+    }
+}
+
+static void jins86_OPrm(struct jit *jit, int op, enum R86_e reg, enum R86_e mem, int disp)
+{
+    JIT_ROOM(jit, JIT_INSN_MAX);
     int rex = 0x48;
     rex |= (reg >= R8) << 2;
     rex |= (mem >= R8) << 0;
     *jit->cur++ = rex;
     *jit->cur++ = op;
-
-    int has8 = (disp8 != 0);
-    int modrm = (has8 << 6);
-    modrm |= (reg & 7) << 3;
-    modrm |= (mem & 7) << 0;
-    *jit->cur++ = modrm;
-    *jit->cur = disp8;
-    jit->cur += has8;
+    jins86_mem(jit, reg, mem, disp, 1);
 }
 
-#define DispVal(disp8) (assert(disp8 >= 0 && disp8 < 128), disp8)
-#define OPrm(op) jins86_OPrm(jit, op, JRto86(dst), JRto86(mem), DispVal(disp8))
-#define OPmr(op) jins86_OPrm(jit, op, JRto86(src), JRto86(mem), DispVal(disp8))
+#define OPrm(op) jins86_OPrm(jit, op, JRto86(dst), JRto86mem(mem), disp)
+#define OPmr(op) jins86_OPrm(jit, op, JRto86(src), JRto86mem(mem), disp)
 
 void jins_MOVrm(struct jit *jit, enum JR_e dst, JINS_MEM_ARG) { OPrm(0x8b); }
 void jins_MOVmr(struct jit *jit, JINS_MEM_ARG, enum JR_e src) { OPmr(0x89); }
 
+void jins_PREFETCH(struct jit *jit, JINS_MEM_ARG)
+{
+    enum R86_e base = JRto86mem(mem);
+    JIT_ROOM(jit, JIT_INSN_MAX);
+    if (base >= R8)
+	*jit->cur++ = 0x41;
+    *jit->cur++ = 0x0f;
+    *jit->cur++ = 0x18;
+    jins86_mem(jit, 1, base, disp, 1);	// /1: prefetcht0
+}
+
 void jins_ADDrm(struct jit *jit, enum JR_e dst, JINS_MEM_ARG) { OPrm(0x03); }
 void jins_SUBrm(struct jit *jit, enum JR_e dst, JINS_MEM_ARG) { OPrm(0x2b); }
 void jins_XORrm(struct jit *jit, enum JR_e dst, JINS_MEM_ARG) { OPrm(0x33); }
+
+static void jins86_OPri(struct jit *jit, int mod, enum R86_e reg, int imm32)
+{
+    JIT_ROOM(jit, JIT_INSN_MAX);
+    int rex = 0x48;
+    rex |= (reg >= R8);
+    *jit->cur++ = rex;
+    int has8 = (imm32 >= -128 && imm32 < 128);
+    *jit->cur++ = has8 ? 0x83 : 0x81;
+
+    int modrm = 3 << 6;
+    modrm |= (mod << 3);
+    modrm |= (reg & 7);
+    *jit->cur++ = modrm;
+    if (has8)
+	*jit->cur++ = imm32;
+    else {
+	memcpy(jit->cur, &imm32, 4);
+	jit->cur += 4;
+    }
+}
+
+#define OPri(mod) jins86_OPri(jit, mod, JRto86(reg), imm32)
+
+void jins_ADDi(struct jit *jit, enum JR_e reg, int imm32) { OPri(0); }
+void jins_SUBi(struct jit *jit, enum JR_e reg, int imm32) { OPri(5); }
+
+void jins_CMP(struct jit *jit, enum JR_e a, enum JR_e b)
+{
+    jins86_OPrr(jit, 0x39, JRto86(a), JRto86(b));
+}
+
+int jit_label(struct jit *jit)
+{
+    assert(jit->nlabel < JIT_MAXLABELS);
+    jit->label[jit->nlabel] = -1;
+    return jit->nlabel++;
+}
+
+void jit_bind(struct jit *jit, int label)
+{
+    assert(label >= 0 && label < jit->nlabel);
+    assert(jit->label[label] < 0);
+    int pos = jit->cur - jit->page;
+    jit->label[label] = pos;
+
+    // Resolve the forward branches, which all take rel32.
+    int n = 0;
+    for (int i = 0; i < jit->nfixup; i++) {
+	if (jit->fixup[i].label != label) {
+	    jit->fixup[n++] = jit->fixup[i];
+	    continue;
+	}
+	int32_t rel = pos - (jit->fixup[i].pos + 4);
+	memcpy(jit->page + jit->fixup[i].pos, &rel, 4);
+    }
+    jit->nfixup = n;
+}
+
+// Condition codes, as in Jcc.
+enum CC_e { CC_Z = 0x4, CC_NZ = 0x5, CC_ALWAYS = -1 };
+
+static void jins86_Jcc(struct jit *jit, int cc, int label)
+{
+    JIT_ROOM(jit, JIT_INSN_MAX);
+    assert(label >= 0 && label < jit->nlabel);
+    int target = jit->label[label];
+    if (target >= 0) {
+	// Backward branch, use rel8 if it fits.
+	int pos = jit->cur - jit->page;
+	int rel8 = target - (pos + 2);
+	if (rel8 >= -128) {
+	    *jit->cur++ = (cc == CC_ALWAYS) ? 0xeb : 0x70 + cc;
+	    *jit->cur++ = rel8;
+	    return;
+	}
+    }
+    if (cc == CC_ALWAYS)
+	*jit->cur++ = 0xe9;
+    else {
+	*jit->cur++ = 0x0f;
+	*jit->cur++ = 0x80 + cc;
+    }
+    int pos = jit->cur - jit->page;
+    int32_t rel = target - (pos + 4);
+    if (target < 0) {
+	assert(jit->nfixup < JIT_MAXFIXUPS);
+	jit->fixup[jit->nfixup].label = label;
+	jit->fixup[jit->nfixup].pos = pos;
+	jit->nfixup++;
+	rel = 0;
+    }
+    memcpy(jit->cur, &rel, 4);
+    jit->cur += 4;
+}
+
+void jins_JMP(struct jit *jit, int label) { jins86_Jcc(jit, CC_ALWAYS, label); }
+void jins_JZ(struct jit *jit, int label) { jins86_Jcc(jit, CC_Z, label); }
+void jins_JNZ(struct jit *jit, int label) { jins86_Jcc(jit, CC_NZ, label); }
+
+void jins_LOOP(struct jit *jit, enum JR_e reg, int label)
+{
+    // DEC reg; JNZ label
+    jins86_OPr(jit, 0xff, 0xc8, JRto86(reg));
+    jins_JNZ(jit, label);
+}
+
+// Vector instructions are encoded with VEX (AVX2, 256-bit)
+// or EVEX (AVX-512, 512-bit) prefixes.
+enum { PP_NONE, PP_66, PP_F3, PP_F2 };
+enum { MAP_0F = 1, MAP_0F38 = 2, MAP_0F3A = 3 };
+
+static int cpu_vlanes = -1;
+
+int jit_vlanes(void)
+{
+    if (cpu_vlanes >= 0)
+	return cpu_vlanes;
+    cpu_vlanes = 0;
+#if defined(__x86_64__) && !defined(_WIN32)
+    // On Windows, the upper vector registers are callee-saved,
+    // and we don't bother to save them.
+    unsigned a, b, c, d;
+    if (!__get_cpuid(1, &a, &b, &c, &d))
+	return 0;
+    // OSXSAVE and AVX
+    if ((c & (1 << 27)) == 0 || (c & (1 << 28)) == 0)
+	return 0;
+    unsigned xcr0_lo, xcr0_hi;
+    __asm__("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+    // The OS must save the YMM state.
+    if ((xcr0_lo & 0x06) != 0x06)
+	return 0;
+    if (!__get_cpuid_count(7, 0, &a, &b, &c, &d))
+	return 0;
+    if (b & (1 << 5))  // AVX2
+	cpu_vlanes = 4;
+    // AVX512F and AVX512BW, plus the opmask and ZMM state.
+    if ((b & (1 << 16)) && (b & (1 << 30)) && (xcr0_lo & 0xe6) == 0xe6)
+	cpu_vlanes = 8;
+#endif
+    return cpu_vlanes;
+}
+
+void jit_vsetup(struct jit *jit, int lanes)
+{
+    assert(lanes == 4 || lanes == 8);
+    assert(lanes <= jit_vlanes());
+    jit->vlanes = lanes;
+}
+
+static int cpu_isa = -1;
+
+int jit_isa(void)
+{
+    if (cpu_isa >= 0)
+	return cpu_isa;
+    // Threads may get here at once: each works out the same bits, and
+    // stores them in one go, so none sees them half done.
+    int isa = 0;
+#if defined(__x86_64__) && !defined(_WIN32)
+    unsigned a, b, c, d;
+    if (__get_cpuid(1, &a, &b, &c, &d) && (c & (1 << 22)))
+	isa |= JIT_ISA_MOVBE;
+    if (__get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & (1 << 8)))
+	isa |= JIT_ISA_BMI2;
+#endif
+    cpu_isa = isa;
+    return isa;
+}
+
+void jit_isa_limit(struct jit *jit, int isa)
+{
+    jit->isa &= isa;
+}
+
+// LEA dst, [a + b]: the SIB byte takes a as the base and b as the index;
+// RBP and R13 as the base need a disp8, and RSP cannot be the index.
+void jins_ADD3(struct jit *jit, enum JR_e dst, enum JR_e a, enum JR_e b)
+{
+    enum R86_e r = JRto86(dst), base = JRto86(a), index = JRto86(b);
+    if ((base & 7) == RBP && (index & 7) != RBP) {
+	enum R86_e t = base;
+	base = index, index = t;
+    }
+    assert(index != RSP);
+    JIT_ROOM(jit, JIT_INSN_MAX);
+    int rex = 0x48;
+    rex |= (r >= R8) << 2;      // REX.R
+    rex |= (index >= R8) << 1;  // REX.X
+    rex |= (base >= R8) << 0;   // REX.B
+    *jit->cur++ = rex;
+    *jit->cur++ = 0x8d;
+    int mod = ((base & 7) == RBP);
+    *jit->cur++ = mod << 6 | (r & 7) << 3 | RSP;  // SIB follows
+    *jit->cur++ = (index & 7) << 3 | (base & 7);
+    if (mod)
+	*jit->cur++ = 0;
+}
+
+// RORX dst, src/[mem], 64-imm8 (VEX.LZ.F2.0F3A.W1 F0 /r ib), the rm
+// operand being a register if mem is negative.
+static void jins86_RORX(struct jit *jit, enum R86_e dst, int src, enum R86_e mem, int disp, int imm8)
+{
+    JIT_ROOM(jit, JIT_INSN_MAX);
+    int rm = (src >= 0) ? src : (int) mem;
+    *jit->cur++ = 0xc4;
+    *jit->cur++ = !(dst & 8) << 7 | 1 << 6 | !(rm & 8) << 5 | MAP_0F3A;
+    *jit->cur++ = 1 << 7 | 15 << 3 | PP_F2;  // W1, no vvvv, LZ
+    *jit->cur++ = 0xf0;
+    if (src >= 0)
+	*jit->cur++ = 0xc0 | (dst & 7) << 3 | (src & 7);
+    else
+	jins86_mem(jit, dst, mem, disp, 1);
+    *jit->cur++ = (64 - imm8) & 63;
+}
+
+void jins_ROTL3(struct jit *jit, enum JR_e dst, enum JR_e src, int imm8)
+{
+    assert(imm8 >= 0 && imm8 < 64);
+    if (jit->isa & JIT_ISA_BMI2) {
+	jins86_RORX(jit, JRto86(dst), JRto86(src), 0, 0, imm8);
+	return;
+    }
+    if (dst != src)
+	jins_MOV(jit, dst, src);
+    jins_ROTL(jit, dst, imm8);
+}
+
+void jins_ROTLrm(struct jit *jit, enum JR_e dst, JINS_MEM_ARG, int imm8)
+{
+    assert(imm8 >= 0 && imm8 < 64);
+    if (jit->isa & JIT_ISA_BMI2) {
+	jins86_RORX(jit, JRto86(dst), -1, JRto86mem(mem), disp, imm8);
+	return;
+    }
+    jins_MOVrm(jit, dst, mem, disp);
+    jins_ROTL(jit, dst, imm8);
+}
+
+// MOVBE dst, [mem] (REX.W 0F 38 F0 /r)
+void jins_BSWAPrm(struct jit *jit, enum JR_e dst, JINS_MEM_ARG)
+{
+    if (jit->isa & JIT_ISA_MOVBE) {
+	enum R86_e reg = JRto86(dst), base = JRto86mem(mem);
+	JIT_ROOM(jit, JIT_INSN_MAX);
+	*jit->cur++ = 0x48 | (reg >= R8) << 2 | (base >= R8);
+	*jit->cur++ = 0x0f;
+	*jit->cur++ = 0x38;
+	*jit->cur++ = 0xf0;
+	jins86_mem(jit, reg, base, disp, 1);
+	return;
+    }
+    jins_MOVrm(jit, dst, mem, disp);
+    jins_BSWAP(jit, dst);
+}
+
+// The VEX or EVEX prefix, depending on the vector width.  The reg and rm
+// register numbers are the full 4-bit ones, and vvvv is the extra source.
+static void jins86_Vprefix(struct jit *jit, int map, int pp, int w, int vvvv, int reg, int rm)
+{
+    JIT_ROOM(jit, JIT_INSN_MAX);
+    assert(jit->vlanes);
+    if (jit->vlanes == 4) {
+	*jit->cur++ = 0xc4;
+	int p0 = map;
+	p0 |= !(reg & 8) << 7;    // ~R
+	p0 |= 1 << 6;             // ~X
+	p0 |= !(rm & 8) << 5;     // ~B
+	*jit->cur++ = p0;
+	int p1 = pp;
+	p1 |= 1 << 2;             // L = 256 bits
+	p1 |= (~vvvv & 15) << 3;
+	p1 |= w << 7;
+	*jit->cur++ = p1;
+    }
+    else {
+	*jit->cur++ = 0x62;
+	int p0 = map;
+	p0 |= !(reg & 8) << 7;    // ~R
+	p0 |= 1 << 6;             // ~X
+	p0 |= !(rm & 8) << 5;     // ~B
+	p0 |= 1 << 4;             // ~R'
+	*jit->cur++ = p0;
+	int p1 = pp;
+	p1 |= 1 << 2;
+	p1 |= (~vvvv & 15) << 3;
+	p1 |= w << 7;
+	*jit->cur++ = p1;
+	int p2 = 2 << 5;          // L'L = 512 bits
+	p2 |= 1 << 3;             // ~V'
+	*jit->cur++ = p2;
+    }
+}
+
+// With EVEX, disp8 is scaled by the size of the vector.
+static void jins86_Vmem(struct jit *jit, int reg, enum R86_e base, int disp)
+{
+    jins86_mem(jit, reg, base, disp, (jit->vlanes == 8) ? 64 : 1);
+}
+
+static void jins86_VOPrrr(struct jit *jit, int map, int pp, int w, int op,
+	enum JV_e dst, enum JV_e src1, enum JV_e src2)
+{
+    jins86_Vprefix(jit, map, pp, w, src1, dst, src2);
+    *jit->cur++ = op;
+    *jit->cur++ = 0xc0 | (dst & 7) << 3 | (src2 & 7);
+}
+
+static void jins86_VOPrrm(struct jit *jit, int map, int pp, int w, int op,
+	enum JV_e dst, enum JV_e src1, enum R86_e mem, int disp)
+{
+    jins86_Vprefix(jit, map, pp, w, src1, dst, mem);
+    *jit->cur++ = op;
+    jins86_Vmem(jit, dst, mem, disp);
+}
+
+// Shift and rotate by immediate: the destination goes to vvvv,
+// and the reg field holds the opcode extension.
+static void jins86_VOPrs(struct jit *jit, int op, int ext, enum JV_e dst, enum JV_e src, int imm8)
+{
+    int w = (jit->vlanes == 8);
+    jins86_Vprefix(jit, MAP_0F, PP_66, w, dst, 0, src);
+    *jit->cur++ = op;
+    *jit->cur++ = 0xc0 | ext << 3 | (src & 7);
+    *jit->cur++ = imm8;
+}
+
+#define VW (jit->vlanes == 8)
+#define VOPrr(op) jins86_VOPrrr(jit, MAP_0F, PP_66, VW, op, dst, dst, src)
+#define VOPrm(op) jins86_VOPrrm(jit, MAP_0F, PP_66, VW, op, dst, dst, JRto86mem(mem), disp)
+
+void jins_VADD(struct jit *jit, enum JV_e dst, enum JV_e src) { VOPrr(0xd4); }
+void jins_VSUB(struct jit *jit, enum JV_e dst, enum JV_e src) { VOPrr(0xfb); }
+void jins_VXOR(struct jit *jit, enum JV_e dst, enum JV_e src) { VOPrr(0xef); }
+
+void jins_VADDrm(struct jit *jit, enum JV_e dst, JINS_MEM_ARG) { VOPrm(0xd4); }
+void jins_VSUBrm(struct jit *jit, enum JV_e dst, JINS_MEM_ARG) { VOPrm(0xfb); }
+void jins_VXORrm(struct jit *jit, enum JV_e dst, JINS_MEM_ARG) { VOPrm(0xef); }
+
+void jins_VMOVrm(struct jit *jit, enum JV_e dst, JINS_MEM_ARG)
+{
+    // VMOVDQU, VMOVDQU64
+    jins86_Vprefix(jit, MAP_0F, PP_F3, VW, 0, dst, JRto86mem(mem));
+    *jit->cur++ = 0x6f;
+    jins86_Vmem(jit, dst, JRto86mem(mem), disp);
+}
+
+void jins_VMOVmr(struct jit *jit, JINS_MEM_ARG, enum JV_e src)
+{
+    jins86_Vprefix(jit, MAP_0F, PP_F3, VW, 0, src, JRto86mem(mem));
+    *jit->cur++ = 0x7f;
+    jins86_Vmem(jit, src, JRto86mem(mem), disp);
+}
+
+void jins_VROTL(struct jit *jit, enum JV_e reg, int imm8)
+{
+    assert(imm8 > 0 && imm8 < 64);
+    if (jit->vlanes == 8) {
+	// VPROLQ
+	jins86_VOPrs(jit, 0x72, 1, reg, reg, imm8);
+	return;
+    }
+    assert(reg != JV15);
+    // VPSRLQ, VPSLLQ, VPOR
+    jins86_VOPrs(jit, 0x73, 2, JV15, reg, 64 - imm8);
+    jins86_VOPrs(jit, 0x73, 6, reg, reg, imm8);
+    jins86_VOPrrr(jit, MAP_0F, PP_66, 0, 0xeb, reg, reg, JV15);
+}
+
+void jins_VBSWAP(struct jit *jit, enum JV_e reg)
+{
+    // VPSHUFB reg, reg, [rip + mask]
+    jins86_Vprefix(jit, MAP_0F38, PP_66, 0, reg, reg, 0);
+    *jit->cur++ = 0x00;
+    *jit->cur++ = (reg & 7) << 3 | 5;
+    assert(jit->npoolref < JIT_MAXPOOLREFS);
+    jit->poolref[jit->npoolref++] = jit->cur - jit->page;
+    memset(jit->cur, 0, 4);
+    jit->cur += 4;
+}
+
+static void jins_VZEROUPPER(struct jit *jit)
+{
+    JIT_ROOM(jit, JIT_INSN_MAX);
+    *jit->cur++ = 0xc5;
+    *jit->cur++ = 0xf8;
+    *jit->cur++ = 0x77;
+}
+
+static void jit_patchSlot(struct jit *jit, int id);
+
+// The constant pool goes after the code, 64-byte aligned.
+static void jit_emitPool(struct jit *jit)
+{
+    int vpatch = 0;
+    for (int i = 0; i < jit->npatch; i++)
+	vpatch |= jit->patch[i].vec;
+    if (jit->npoolref == 0 && !vpatch)
+	return;
+    JIT_ROOM(jit, 2 * 64);
+    while ((jit->cur - jit->page) % 64)
+	*jit->cur++ = 0xcc;
+    // The shuffle mask that reverses the bytes in each qword.
+    int pos = jit->cur - jit->page;
+    // VPSHUFB indexes bytes within each 128-bit lane.
+    for (int i = 0; i < 64; i++)
+	*jit->cur++ = (i & 8) | (7 - (i & 7));
+    for (int i = 0; i < jit->npoolref; i++) {
+	int ref = jit->poolref[i];
+	int32_t rel = pos - (ref + 4);
+	memcpy(jit->page + ref, &rel, 4);
+    }
+    // The vector slots can only refer to the pool now.
+    jit->pool = pos;
+    for (int i = 0; i < jit->npatch; i++)
+	if (jit->patch[i].vec)
+	    jit_patchSlot(jit, i);
+}
+
+// Multi-byte NOPs, as recommended by Intel, up to 9 bytes each.
+static void jit86_NOP(uint8_t *p, int n)
+{
+    static const uint8_t nop[9][9] = {
+	{ 0x90 },
+	{ 0x66, 0x90 },
+	{ 0x0f, 0x1f, 0x00 },
+	{ 0x0f, 0x1f, 0x40, 0x00 },
+	{ 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+	{ 0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+	{ 0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00 },
+	{ 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+	{ 0x66, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+    };
+    while (n > 0) {
+	int k = n < 9 ? n : 9;
+	memcpy(p, nop[k-1], k);
+	p += k, n -= k;
+    }
+}
+
+// Encode the rotation (or BSWAP, by 0) into buf, rather than into
+// the code, and return the length.  A vector BSWAP refers to the pool
+// at the end of the slot, which is fixed up by the caller.
+static int jit_patchEncode(struct jit *jit, uint8_t *buf, size_t bufsize, int vec, int reg, int imm8)
+{
+    uint8_t *cur = jit->cur, *end = jit->end;
+    int npoolref = jit->npoolref;
+    jit->cur = buf;
+    jit->end = buf + bufsize;
+    if (!vec && imm8)
+	jins_ROTL(jit, reg, imm8);
+    else if (!vec)
+	jins_BSWAP(jit, reg);
+    else if (imm8)
+	jins_VROTL(jit, reg, imm8);
+    else
+	jins_VBSWAP(jit, reg);
+    int len = jit->cur - buf;
+    jit->cur = cur;
+    jit->end = end;
+    jit->npoolref = npoolref;
+    return len;
+}
+
+// (Re)write the slot with its current rotation, padded with NOPs.
+static void jit_patchSlot(struct jit *jit, int id)
+{
+    uint8_t buf[64];
+    int pos = jit->patch[id].pos, size = jit->patch[id].size;
+    int vec = jit->patch[id].vec, imm8 = jit->patch[id].imm8;
+    int len = jit_patchEncode(jit, buf, sizeof buf, vec, jit->patch[id].reg, imm8);
+    assert(len <= size);
+    if (vec && imm8 == 0) {
+	// Until the pool is placed, the reference is left blank.
+	int32_t rel = jit->pool < 0 ? 0 : jit->pool - (pos + len);
+	memcpy(buf + len - 4, &rel, 4);
+    }
+    memcpy(jit->page + pos, buf, len);
+    jit86_NOP(jit->page + pos + len, size - len);
+}
+
+static int jit_newPatch(struct jit *jit, int vec, int reg, int imm8)
+{
+    assert(imm8 >= 0 && imm8 < 64);
+    // The slot fits both the rotation and BSWAP.
+    uint8_t buf[64];
+    int size = jit_patchEncode(jit, buf, sizeof buf, vec, reg, 1);
+    int size0 = jit_patchEncode(jit, buf, sizeof buf, vec, reg, 0);
+    if (size < size0)
+	size = size0;
+    JIT_ROOM(jit, (size_t) size);
+    if (jit->npatch == jit->maxpatch) {
+	jit->maxpatch = jit->maxpatch ? 2 * jit->maxpatch : 64;
+	jit->patch = realloc(jit->patch, jit->maxpatch * sizeof *jit->patch);
+	assert(jit->patch);
+    }
+    int id = jit->npatch++;
+    jit->patch[id].pos = jit->cur - jit->page;
+    jit->patch[id].size = size;
+    jit->patch[id].vec = vec;
+    jit->patch[id].reg = reg;
+    jit->patch[id].imm8 = imm8;
+    jit->cur += size;
+    jit_patchSlot(jit, id);
+    return id;
+}
+
+int jins_ROTLp(struct jit *jit, enum JR_e reg, int imm8)
+{
+    assert(reg >= 0 && reg < JR_SP);
+    return jit_newPatch(jit, 0, reg, imm8);
+}
+
+int jins_VROTLp(struct jit *jit, enum JV_e reg, int imm8)
+{
+    assert(jit->vlanes);
+    return jit_newPatch(jit, 1, reg, imm8);
+}
+
+void jit_patch(struct jit *jit, int id, int imm8)
+{
+    assert(id >= 0 && id < jit->npatch);
+    assert(imm8 >= 0 && imm8 < 64);
+    if (jit->patch[id].imm8 == imm8)
+	return;
+    jit->patch[id].imm8 = imm8;
+    jit_patchSlot(jit, id);
+}
+
+// The perf files, -1 if not open.
+static int perf_mapfd = -1;
+static int perf_dumpfd = -1;
+// The dump is mapped executable, which is how perf record finds it.
+static void *perf_marker;
+static uint64_t perf_index;
+
+// The jitdump format, see tools/perf/Documentation/jitdump-specification.txt
+// in the Linux sources.
+#define JITDUMP_MAGIC 0x4A695444
+#define JITDUMP_VERSION 1
+#define JITDUMP_CODE_LOAD 0
+#define JITDUMP_CODE_CLOSE 3
+#define JITDUMP_EM_X86_64 62
+
+struct jitdump_header {
+    uint32_t magic, version, total_size, elf_mach, pad1, pid;
+    uint64_t timestamp, flags;
+};
+
+struct jitdump_record {
+    uint32_t id, total_size;
+    uint64_t timestamp;
+};
+
+struct jitdump_load {
+    struct jitdump_record rec;
+    uint32_t pid, tid;
+    uint64_t vma, code_addr, code_size, code_index;
+    // followed by the name, with the NUL, and the code
+};
+
+// perf record -k mono stamps the samples with this clock.
+static uint64_t jit_perf_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int jit_perf_open(int flags)
+{
+#ifdef __linux__
+    char path[64];
+    jit_pagesize();
+    if (flags & JIT_PERF_MAP) {
+	snprintf(path, sizeof path, "/tmp/perf-%d.map", (int) getpid());
+	perf_mapfd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (perf_mapfd < 0)
+	    return -1;
+    }
+    if (flags & JIT_PERF_DUMP) {
+	snprintf(path, sizeof path, "/tmp/jit-%d.dump", (int) getpid());
+	perf_dumpfd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (perf_dumpfd < 0) {
+	    jit_perf_close();
+	    return -1;
+	}
+	struct jitdump_header h = {
+	    JITDUMP_MAGIC, JITDUMP_VERSION, sizeof h, JITDUMP_EM_X86_64,
+	    0, getpid(), jit_perf_time(), 0,
+	};
+	perf_marker = mmap(NULL, pagesize, PROT_READ | PROT_EXEC, MAP_PRIVATE, perf_dumpfd, 0);
+	if (perf_marker == MAP_FAILED || write(perf_dumpfd, &h, sizeof h) != sizeof h) {
+	    perf_marker = NULL;
+	    jit_perf_close();
+	    return -1;
+	}
+    }
+    return 0;
+#else
+    (void) flags;
+    return -1;
+#endif
+}
+
+void jit_perf_close(void)
+{
+    if (perf_dumpfd >= 0) {
+	struct jitdump_record rec = { JITDUMP_CODE_CLOSE, sizeof rec, jit_perf_time() };
+	if (write(perf_dumpfd, &rec, sizeof rec) != sizeof rec)
+	    assert(!"jitdump write");
+	if (perf_marker)
+	    munmap(perf_marker, pagesize);
+	perf_marker = NULL;
+	close(perf_dumpfd);
+	perf_dumpfd = -1;
+    }
+    if (perf_mapfd >= 0) {
+	close(perf_mapfd);
+	perf_mapfd = -1;
+    }
+}
+
+void jit_name(struct jit *jit, const char *name)
+{
+    // only kept if someone is going to look
+    if (perf_mapfd < 0 && perf_dumpfd < 0)
+	return;
+    free(jit->name);
+    jit->name = strdup(name);
+    assert(jit->name);
+}
+
+// Announce the compiled function, the code and the pool, each in a single
+// write, so that the records from several threads do not interleave.
+static void jit_perf_load(struct jit *jit)
+{
+    if (perf_mapfd < 0 && perf_dumpfd < 0)
+	return;
+    char buf[64];
+    const char *name = jit->name;
+    if (!name) {
+	snprintf(buf, sizeof buf, "jit_%p", (void *) jit->page);
+	name = buf;
+    }
+    size_t size = jit->cur - jit->page;
+    if (perf_mapfd >= 0) {
+	char line[256];
+	int len = snprintf(line, sizeof line, "%lx %zx %s\n", (unsigned long) jit->page, size, name);
+	assert(len > 0 && len < (int) sizeof line);
+	if (write(perf_mapfd, line, len) != len)
+	    assert(!"perf map write");
+    }
+    if (perf_dumpfd >= 0) {
+	size_t namelen = strlen(name) + 1;
+	struct jitdump_load load = {
+	    { JITDUMP_CODE_LOAD, sizeof load + namelen + size, jit_perf_time() },
+#ifdef __linux__
+	    getpid(), syscall(SYS_gettid),
+#else
+	    getpid(), 0,
+#endif
+	    (uintptr_t) jit->page, (uintptr_t) jit->page, size,
+	    __atomic_fetch_add(&perf_index, 1, __ATOMIC_RELAXED),
+	};
+	uint8_t *rec = malloc(load.rec.total_size);
+	assert(rec);
+	memcpy(rec, &load, sizeof load);
+	memcpy(rec + sizeof load, name, namelen);
+	memcpy(rec + sizeof load + namelen, jit->page, size);
+	if (write(perf_dumpfd, rec, load.rec.total_size) != load.rec.total_size)
+	    assert(!"jitdump write");
+	free(rec);
+    }
+}
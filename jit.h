@@ -26,10 +26,12 @@ extern "C" {
 
 // This JIT virtual machine provides 15 general-purpose registers,
 // coincidentally numbered starting with 0 (so you don't have to use
-// their names).
+// their names).  JR_SP is the stack pointer, which can only be used
+// as a base register, to address the frame.
 enum JR_e {
     JR0, JR1, JR2, JR3, JR4, JR5, JR6, JR7,
     JR8, JR9, JR10, JR11, JR12, JR13, JR14,
+    JR_SP,
 };
 
 // The calling convention: arguments are passed in R14, R13, R12, R11,
@@ -43,10 +45,15 @@ enum JR_e {
 struct jit *jit_new(void);
 void jit_free(struct jit *jit);
 
-// A memory reference: base register with displacement.
-#define JINS_MEM(reg, disp8) reg, disp8
+// A memory reference: base register with displacement (disp32).
+#define JINS_MEM(reg, disp) reg, disp
 #define JINS_MEM0(reg) reg, 0
-#define JINS_MEM_ARG enum JR_e mem, int disp8
+#define JINS_MEM_ARG enum JR_e mem, int disp
+
+// Reserve a stack frame of so many bytes, to be addressed as
+// JINS_MEM(JR_SP, 0..size-1), e.g. to spill registers.  This must
+// come right after jit_new(), before any instructions.
+void jit_frame(struct jit *jit, int size);
 
 // Feed some instructions into the JIT compiler.
 void jins_ADD(struct jit *jit, enum JR_e dst, enum JR_e src);
@@ -67,9 +74,133 @@ void jins_MOV(struct jit *jit, enum JR_e dst, enum JR_e src);
 void jins_MOVrm(struct jit *jit, enum JR_e dst, JINS_MEM_ARG);
 void jins_MOVmr(struct jit *jit, JINS_MEM_ARG, enum JR_e src);
 
+// A hint to bring the cache line at the address into all cache levels
+// (prefetcht0).  The address need not be valid, it never faults.
+void jins_PREFETCH(struct jit *jit, JINS_MEM_ARG);
+
+// Newer scalar instructions, used where the CPU has them: RORX (BMI2)
+// and MOVBE.  jit_isa() tells which it has, and jit_isa_limit() keeps
+// a jit to some of them, e.g. to test or time the fallbacks.
+enum { JIT_ISA_BMI2 = 1, JIT_ISA_MOVBE = 2 };
+int jit_isa(void);
+void jit_isa_limit(struct jit *jit, int isa);
+
+// Three-operand forms, which need no copy: dst = a + b (LEA), and
+// dst = src rotated left (RORX, else MOV and ROL).
+void jins_ADD3(struct jit *jit, enum JR_e dst, enum JR_e a, enum JR_e b);
+void jins_ROTL3(struct jit *jit, enum JR_e dst, enum JR_e src, int imm8);
+
+// Load and rotate left (RORX, else MOV and ROL), or load and swap
+// the bytes (MOVBE, else MOV and BSWAP).
+void jins_ROTLrm(struct jit *jit, enum JR_e dst, JINS_MEM_ARG, int imm8);
+void jins_BSWAPrm(struct jit *jit, enum JR_e dst, JINS_MEM_ARG);
+
+// Arithmetic with an immediate, e.g. to advance a pointer.
+void jins_ADDi(struct jit *jit, enum JR_e reg, int imm32);
+void jins_SUBi(struct jit *jit, enum JR_e reg, int imm32);
+
+// Labels are allocated with jit_label() and placed with jit_bind().
+// A branch can refer to a label that has not been bound yet.
+int jit_label(struct jit *jit);
+void jit_bind(struct jit *jit, int label);
+
+// Branches; JZ and JNZ follow a CMP (or any arithmetic instruction).
+void jins_CMP(struct jit *jit, enum JR_e a, enum JR_e b);
+void jins_JMP(struct jit *jit, int label);
+void jins_JZ(struct jit *jit, int label);
+void jins_JNZ(struct jit *jit, int label);
+
+// A counted loop: decrement the register, and branch back
+// to the label unless it drops to zero.
+void jins_LOOP(struct jit *jit, enum JR_e reg, int label);
+
+// The vector unit has 16 registers, each holding several independent
+// 64-bit lanes.  JV15 is clobbered by VROTL when there is no native
+// vector rotate (AVX2).
+enum JV_e {
+    JV0, JV1, JV2, JV3, JV4, JV5, JV6, JV7,
+    JV8, JV9, JV10, JV11, JV12, JV13, JV14, JV15,
+};
+
+// The number of lanes the CPU can do: 8 with AVX-512 (F and BW),
+// 4 with AVX2, or 0 if vector instructions are not supported.
+int jit_vlanes(void);
+
+// Before adding vector instructions, select the number of lanes,
+// which must not exceed jit_vlanes().
+void jit_vsetup(struct jit *jit, int lanes);
+
+void jins_VADD(struct jit *jit, enum JV_e dst, enum JV_e src);
+void jins_VSUB(struct jit *jit, enum JV_e dst, enum JV_e src);
+void jins_VXOR(struct jit *jit, enum JV_e dst, enum JV_e src);
+
+void jins_VROTL(struct jit *jit, enum JV_e reg, int imm8);
+void jins_VBSWAP(struct jit *jit, enum JV_e reg);
+
+// Vector memory operands need not be aligned.
+void jins_VADDrm(struct jit *jit, enum JV_e dst, JINS_MEM_ARG);
+void jins_VSUBrm(struct jit *jit, enum JV_e dst, JINS_MEM_ARG);
+void jins_VXORrm(struct jit *jit, enum JV_e dst, JINS_MEM_ARG);
+
+void jins_VMOVrm(struct jit *jit, enum JV_e dst, JINS_MEM_ARG);
+void jins_VMOVmr(struct jit *jit, JINS_MEM_ARG, enum JV_e src);
+
 // After all the instruction are added, obtain a callable function.
 void *jit_compile(struct jit *jit);
 
+// Rotations which can be changed after the function is compiled, without
+// compiling it again.  A rotation by 0 is BSWAP.  Each gets a slot large
+// enough for either, padded with NOPs, and the returned patch id, which
+// counts from 0.  JV15 is clobbered as with VROTL.
+int jins_ROTLp(struct jit *jit, enum JR_e reg, int imm8);
+int jins_VROTLp(struct jit *jit, enum JV_e reg, int imm8);
+
+// Rewrite the rotation (0..63) in the compiled function.  The code must
+// be made writable first, with jit_unprotect(), or jit_arena_unseal() if
+// the function is in an arena, and then callable again, with jit_protect()
+// or jit_arena_seal().  Patching many rotations at once thus costs only
+// two system calls.
+void jit_patch(struct jit *jit, int id, int imm8);
+void jit_unprotect(struct jit *jit);
+void jit_protect(struct jit *jit);
+
+// An arena packs many functions into a few large mappings, which can be
+// reused.  Functions are added with jit_new_arena() and jit_compile(),
+// one at a time, and become callable after jit_arena_seal(), which flips
+// the permissions for all of them at once.  jit_arena_reset() discards
+// all the functions and makes the arena writable again.  jit_free()
+// only frees the struct jit, the code stays in the arena; but the
+// struct jit is needed to patch the function, see jit_patch().
+// jit_arena_unseal() makes the arena writable, keeping the functions.
+struct jit_arena *jit_arena_new(void);
+void jit_arena_free(struct jit_arena *arena);
+struct jit *jit_new_arena(struct jit_arena *arena);
+void jit_arena_seal(struct jit_arena *arena);
+void jit_arena_unseal(struct jit_arena *arena);
+void jit_arena_reset(struct jit_arena *arena);
+
+// Make the functions visible to perf, which otherwise sees samples at
+// anonymous addresses.  Every function compiled after jit_perf_open() is
+// announced under its jit_name(), or else "jit_" and its address:
+// JIT_PERF_MAP appends a line to /tmp/perf-PID.map, which perf report
+// picks up by itself; JIT_PERF_DUMP adds a record with the code to
+// /tmp/jit-PID.dump, which perf inject --jit merges into a recording
+// made with perf record -k mono, so that perf annotate can disassemble
+// the functions too.  The dump has the code as compiled, before any
+// jit_patch().  The map has one name per address for the whole run, so
+// it is only right for code that stays put: the functions compiled into
+// an arena that is reset and reused share their addresses, perf shows
+// them all under one name, and the map grows by a line for each.  The
+// dump records when each function was compiled, and keeps them apart.
+// Returns 0, or -1 with errno set if the files cannot be opened.  The
+// records are written whole, so threads can compile concurrently.
+enum { JIT_PERF_MAP = 1, JIT_PERF_DUMP = 2 };
+int jit_perf_open(int flags);
+void jit_perf_close(void);
+
+// Name the function, any time before jit_compile().
+void jit_name(struct jit *jit, const char *name);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,131 @@
+#pragma once
+
+//
+// Mix functions compiled by the C++ compiler rather than the JIT, from
+// tables known at compile time, to tell how fast a design really is
+// when an optimizing compiler gets to schedule it.  Needs C++17.
+//
+// The tables are laid out as in the Sieve, which loads its presets from
+// them: op[0] feeds the data into each var, op[1..4] mix, each of them
+// done for every var in turn, with both vars offset by that var; a
+// rotation takes the shift of that var, and a shift of 0 (mod 64) is a
+// byte swap.  The whole block is unrolled, and every index is a
+// constant, so the state stays in registers.
+//
+
+#include <stdint.h>
+#include <stddef.h>
+#include <utility>
+
+namespace mix {
+
+enum Op { ADD, SUB, XOR, ROT };
+
+// SpookyHash V2.
+struct Spooky
+{
+  static constexpr int vars = 12;
+  static constexpr Op op[5] = { ADD, XOR, XOR, ROT, ADD };
+  static constexpr int v1[5] = { 0, 2, 11, 0, 11 };
+  static constexpr int v2[5] = { 0, 10, 0, 0, 1 };
+  static constexpr int s[12] = { 11, 32, 43, 31, 17, 28, 39, 57, 55, 54, 22, 46 };
+};
+
+// SpookyAlpha.
+struct Alpha
+{
+  static constexpr int vars = 12;
+  static constexpr Op op[5] = { ADD, ROT, XOR, ADD, ADD };
+  static constexpr int v1[5] = { 0, 11, 9, 11, 1 };
+  static constexpr int v2[5] = { 0, 11, 1, 10, 10 };
+  static constexpr int s[12] = { 32, 41, 12, 24, 8, 42, 32, 13, 30, 20, 47, 16 };
+};
+
+// AkronHash.
+struct Akron
+{
+  static constexpr int vars = 12;
+  static constexpr Op op[5] = { ADD, ROT, XOR, ADD, ADD };
+  static constexpr int v1[5] = { 0, 2, 2, 4, 0 };
+  static constexpr int v2[5] = { 0, 2, 0, 0, 3 };
+  static constexpr int s[12] = { 32, 37, 27, 48, 5, 7, 50, 18, 9, 44, 14, 30 };
+};
+
+// T is a table like the ones above; Iters rounds of mixing per block.
+template <class T, int Iters = 1>
+class Mix
+{
+public:
+  static constexpr int vars = T::vars;
+
+  // Mix one block of data into the state.
+  static inline void Block(uint64_t *s, const uint64_t *data)
+  {
+    for (int iIter=0; iIter<Iters; ++iIter)
+      Vars(s, data, std::make_integer_sequence<int, vars>());
+  }
+
+  // Mix consecutive blocks of data into the state, which is kept in
+  // the variables meanwhile; the same signature as a compiled stream
+  // function of the JIT.
+  static void Stream(uint64_t *state, const uint64_t *data, size_t blocks)
+  {
+    uint64_t s[vars];
+    for (int iVar=0; iVar<vars; ++iVar)
+      s[iVar] = state[iVar];
+    for (size_t i=0; i<blocks; ++i, data += vars)
+      Block(s, data);
+    for (int iVar=0; iVar<vars; ++iVar)
+      state[iVar] = s[iVar];
+  }
+
+private:
+  template <int... iVar>
+  static inline void Vars(uint64_t *s, const uint64_t *data, std::integer_sequence<int, iVar...>)
+  {
+    (Var<iVar>(s, data), ...);
+  }
+
+  template <int iVar>
+  static inline void Var(uint64_t *s, const uint64_t *data)
+  {
+    Apply<T::op[0]>(s[iVar], data[iVar]);
+    Step<1, iVar>(s);
+    Step<2, iVar>(s);
+    Step<3, iVar>(s);
+    Step<4, iVar>(s);
+  }
+
+  template <int iOp, int iVar>
+  static inline void Step(uint64_t *s)
+  {
+    constexpr int dst = (T::v1[iOp] + iVar) % vars;
+    constexpr int src = (T::v2[iOp] + iVar) % vars;
+    if constexpr (T::op[iOp] == ROT)
+      s[dst] = Rot<T::s[iVar] % 64>(s[dst]);
+    else
+      Apply<T::op[iOp]>(s[dst], s[src]);
+  }
+
+  template <Op op>
+  static inline void Apply(uint64_t& x, uint64_t y)
+  {
+    if constexpr (op == ADD)
+      x += y;
+    else if constexpr (op == SUB)
+      x -= y;
+    else
+      x ^= y;
+  }
+
+  template <int k>
+  static inline uint64_t Rot(uint64_t x)
+  {
+    if constexpr (k == 0)
+      return __builtin_bswap64(x);
+    else
+      return (x << k) | (x >> (64 - k));
+  }
+};
+
+}
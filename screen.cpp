@@ -3,8 +3,35 @@
 #include <stdint.h>
 #include <assert.h>
 #include <limits.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <signal.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/mman.h>
 #include <algorithm>
+#include <string>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#include <x86intrin.h>
+#define HAVE_SIMD_COUNT 1
+#endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
 #include "jit.h"
+#include "mix.h"
 
 //
 // try to find an adequate long-message mixing function for SpookyHash
@@ -42,573 +69,4023 @@ public:
 };
 
 
-// random number generator
-class Random : UInt64Helper
-{ 
+// How many bits the difference between a pair of hashes affects, in
+// several ways of looking at it, accumulated over a few trials.  For
+// each var, measure k is the OR over the trials of
+//   a0, a1, a0^a1, gray(a0-a1), gray(a0+a1), and their complements,
+// i.e. bits that are set at least once (or clear at least once).
+// The OR of the complements is the complement of the AND, so the
+// complement measures come from an AND accumulator instead.
+class Counter : UInt64Helper
+{
 public:
-    inline uint64_t Value()
-    {
-        uint64_t e = m_a - Rot64(m_b, 23);
-        m_a = m_b ^ Rot64(m_c, 16);
-        m_b = m_c + Rot64(m_d, 11);
-        m_c = m_d + e;
-        m_d = e + m_a;
-        return m_d;
-    }
+  static const int _measures = 10;
+  static const int _base = 5;      // a[5..9] are complements of a[0..4]
 
-    inline void Init( uint64_t seed)
+  // x and y are [trials][vars], the first and second of each pair
+  typedef void (*func_t)(const uint64_t *x, const uint64_t *y,
+			 int trials, int vars, int count[_measures]);
+
+  // by name: scalar, avx2, avx512; or the best this CPU can do if NULL
+  static func_t Select(const char *name)
+  {
+    if (name == NULL)
     {
-        m_a = 0xdeadbeef; 
-        m_b = m_c = m_d = seed;
-        for (int i=0; i<20; ++i) 
-            (void)Value();
+#ifdef HAVE_SIMD_COUNT
+      if (__builtin_cpu_supports("avx512f") &&
+	  __builtin_cpu_supports("avx512vpopcntdq"))
+	return CountAVX512;
+      if (__builtin_cpu_supports("avx2"))
+	return CountAVX2;
+#endif
+      return CountScalar;
     }
+    if (strcmp(name, "scalar") == 0)
+      return CountScalar;
+#ifdef HAVE_SIMD_COUNT
+    if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2"))
+      return CountAVX2;
+    if (strcmp(name, "avx512") == 0 &&
+	__builtin_cpu_supports("avx512f") &&
+	__builtin_cpu_supports("avx512vpopcntdq"))
+      return CountAVX512;
+#endif
+    return NULL;
+  }
 
 private:
-    uint64_t m_a;
-    uint64_t m_b;
-    uint64_t m_c;
-    uint64_t m_d;
-};
-
-
-// generate, test, and report mixing functions
-class Sieve : UInt64Helper
-{
-  enum OP_e { OP_ADD, OP_SUB, OP_XOR, OP_ROT };
-  enum { MOD_ADDSUB = OP_XOR, MOD_BINOP = OP_ROT };
-
-  inline void EmitOp(int iOp, int OP)
+  static inline void Base(uint64_t a0, uint64_t a1, uint64_t m[_base])
   {
-    _op[iOp] = OP;
+    m[0] = a0;
+    m[1] = a1;
+    m[2] = a0 ^ a1;                  // xor of first and second
+    m[3] = a0 - a1;
+    m[3] ^= m[3] >> 1;               // "-" of first and second, graycoded
+    m[4] = a0 + a1;
+    m[4] ^= m[4] >> 1;               // "+" of first and second, graycoded
   }
-  inline void SetBinopVars(int iOp, int L, int R)
+
+  // vars [from, vars), one at a time
+  static void CountTail(const uint64_t *x, const uint64_t *y,
+			int trials, int vars, int from, int count[_measures])
   {
-    assert(_op[iOp] < MOD_BINOP);
-    _v1[iOp] = L;
-    _v2[iOp] = R;
+    for (int iVar=from; iVar<vars; ++iVar)
+    {
+      uint64_t any[_base] = {}, all[_base];
+      std::fill(all, all + _base, ~(uint64_t)0);
+      for (int iTrial=0; iTrial<trials; ++iTrial)
+      {
+	uint64_t m[_base];
+	Base(x[iTrial*vars + iVar], y[iTrial*vars + iVar], m);
+	for (int k=0; k<_base; ++k)
+	{
+	  any[k] |= m[k];
+	  all[k] &= m[k];
+	}
+      }
+      for (int k=0; k<_base; ++k)
+      {
+	count[k] += Popcnt(any[k]);
+	count[k + _base] += 64 - Popcnt(all[k]);
+      }
+    }
   }
-  inline void EmitRot(int iOp, int LR)
+
+  static void CountScalar(const uint64_t *x, const uint64_t *y,
+			  int trials, int vars, int count[_measures])
   {
-    _op[iOp] = OP_ROT;
-    _v1[iOp] = _v2[iOp] = LR;
+    std::fill(count, count + _measures, 0);
+    CountTail(x, y, trials, vars, 0, count);
   }
 
-public:
-  Sieve(int seed, FILE *fp)
+#ifdef HAVE_SIMD_COUNT
+  // popcount of each byte with a nibble lookup, summed into 64-bit lanes
+  __attribute__((target("avx2")))
+  static inline __m256i Popcnt256(__m256i v)
   {
-    _r.Init(seed);
-    _fp = fp;
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+					 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, low));
+    __m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi64(v, 4), low));
+    return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
   }
 
-  ~Sieve()
+  __attribute__((target("avx2")))
+  static inline int Sum256(__m256i v)
   {
+    __m128i s = _mm_add_epi64(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    return _mm_cvtsi128_si64(s) + _mm_extract_epi64(s, 1);
   }
 
-  // Restore to the original SpookyMix function.
-  void PreloadSpooky()
+  __attribute__((target("avx2")))
+  static void CountAVX2(const uint64_t *x, const uint64_t *y,
+			int trials, int vars, int count[_measures])
   {
-    assert(_ops == 5);
-    assert(_vars == 12);
-
-    EmitOp(0, OP_ADD);
-    EmitOp(1, OP_XOR); SetBinopVars(1, 2, 10);
-    EmitOp(2, OP_XOR); SetBinopVars(2, 11, 0);
-    EmitOp(3, OP_ROT); EmitRot(3, 0);
-    EmitOp(4, OP_ADD); SetBinopVars(4, 11, 1);
+    __m256i sum[_measures];
+    for (int k=0; k<_measures; ++k)
+      sum[k] = _mm256_setzero_si256();
+    int iVar = 0;
+    for (; iVar+4<=vars; iVar+=4)
+    {
+      __m256i any[_base], all[_base];
+      for (int k=0; k<_base; ++k)
+      {
+	any[k] = _mm256_setzero_si256();
+	all[k] = _mm256_set1_epi64x(-1);
+      }
+      for (int iTrial=0; iTrial<trials; ++iTrial)
+      {
+	__m256i a0 = _mm256_loadu_si256((const __m256i *) (x + iTrial*vars + iVar));
+	__m256i a1 = _mm256_loadu_si256((const __m256i *) (y + iTrial*vars + iVar));
+	__m256i d = _mm256_sub_epi64(a0, a1);
+	__m256i s = _mm256_add_epi64(a0, a1);
+	__m256i m[_base] = {
+	  a0, a1, _mm256_xor_si256(a0, a1),
+	  _mm256_xor_si256(d, _mm256_srli_epi64(d, 1)),
+	  _mm256_xor_si256(s, _mm256_srli_epi64(s, 1)),
+	};
+	for (int k=0; k<_base; ++k)
+	{
+	  any[k] = _mm256_or_si256(any[k], m[k]);
+	  all[k] = _mm256_and_si256(all[k], m[k]);
+	}
+      }
+      for (int k=0; k<_base; ++k)
+      {
+	sum[k] = _mm256_add_epi64(sum[k], Popcnt256(any[k]));
+	sum[k + _base] = _mm256_add_epi64(sum[k + _base], Popcnt256(all[k]));
+      }
+    }
+    for (int k=0; k<_base; ++k)
+    {
+      count[k] = Sum256(sum[k]);
+      count[k + _base] = 64*iVar - Sum256(sum[k + _base]);
+    }
+    CountTail(x, y, trials, vars, iVar, count);
+  }
 
-    const uint8_t shifts[] = { 11, 32, 43, 31, 17, 28, 39, 57, 55, 54, 22, 46, };
-    for (int iVar=0; iVar<_vars; ++iVar)
-      _s[iVar] = _s[iVar + _vars] = shifts[iVar];
+  __attribute__((target("avx512f")))
+  static inline int Sum512(__m512i v)
+  {
+    uint64_t a[8];
+    _mm512_storeu_si512(a, v);
+    return a[0] + a[1] + a[2] + a[3] + a[4] + a[5] + a[6] + a[7];
   }
 
-  // Examine the mixing function from SpookyAlpha.
-  void PreloadAlpha()
+  __attribute__((target("avx512f,avx512vpopcntdq")))
+  static void CountAVX512(const uint64_t *x, const uint64_t *y,
+			  int trials, int vars, int count[_measures])
   {
-    assert(_ops == 5);
-    assert(_vars == 12);
+    __m512i sum[_measures];
+    for (int k=0; k<_measures; ++k)
+      sum[k] = _mm512_setzero_si512();
+    for (int iVar=0; iVar<vars; iVar+=8)
+    {
+      // the vars past the end load as zeros, and count as none
+      __mmask8 mask = (vars - iVar >= 8) ? 0xff : (1 << (vars - iVar)) - 1;
+      __m512i any[_base], all[_base];
+      for (int k=0; k<_base; ++k)
+      {
+	any[k] = _mm512_setzero_si512();
+	all[k] = _mm512_set1_epi64(-1);
+      }
+      for (int iTrial=0; iTrial<trials; ++iTrial)
+      {
+	__m512i a0 = _mm512_maskz_loadu_epi64(mask, x + iTrial*vars + iVar);
+	__m512i a1 = _mm512_maskz_loadu_epi64(mask, y + iTrial*vars + iVar);
+	__m512i d = _mm512_sub_epi64(a0, a1);
+	__m512i s = _mm512_add_epi64(a0, a1);
+	__m512i m[_base] = {
+	  a0, a1, _mm512_xor_si512(a0, a1),
+	  _mm512_xor_si512(d, _mm512_maskz_srli_epi64(0xff, d, 1)),
+	  _mm512_xor_si512(s, _mm512_maskz_srli_epi64(0xff, s, 1)),
+	};
+	for (int k=0; k<_base; ++k)
+	{
+	  any[k] = _mm512_or_si512(any[k], m[k]);
+	  all[k] = _mm512_and_si512(all[k], m[k]);
+	}
+      }
+      for (int k=0; k<_base; ++k)
+      {
+	sum[k] = _mm512_add_epi64(sum[k], _mm512_popcnt_epi64(any[k]));
+	sum[k + _base] = _mm512_add_epi64(sum[k + _base], _mm512_popcnt_epi64(all[k]));
+      }
+    }
+    for (int k=0; k<_base; ++k)
+    {
+      count[k] = Sum512(sum[k]);
+      count[k + _base] = 64*vars - Sum512(sum[k + _base]);
+    }
+  }
+#endif
+};
 
-    EmitOp(0, OP_ADD);
-    EmitOp(1, OP_ROT); EmitRot(1, 11);
-    EmitOp(2, OP_XOR); SetBinopVars(2, 9, 1);
-    EmitOp(3, OP_ADD); SetBinopVars(3, 11, 10);
-    EmitOp(4, OP_ADD); SetBinopVars(4, 1, 10);
 
-    const uint8_t shifts[] = { 32, 41, 12, 24, 8, 42, 32, 13, 30, 20, 47, 16, };
-    for (int iVar=0; iVar<_vars; ++iVar)
-      _s[iVar] = _s[iVar + _vars] = shifts[iVar];
-  }
+// The full avalanche matrix: how often each output bit flips when each
+// input bit is flipped, over many trials.  The differences of a trial
+// go to byte counters, a bit to a byte, with SIMD where there is, and
+// the bytes are flushed to the matrix before they can wrap.
+class Bias : UInt64Helper
+{
+public:
+  // adds the bits of diff[0..words), one to each byte of counts
+  typedef void (*func_t)(const uint64_t *diff, int words, uint8_t *counts);
 
-  // Another Bob's brainchild was AkronHash.
-  void PreloadAkron()
+  // by name: scalar, avx2, avx512; or the best this CPU can do if NULL
+  static func_t Select(const char *name)
   {
-    assert(_ops == 5);
-    assert(_vars == 12);
+    if (name == NULL)
+    {
+#ifdef HAVE_SIMD_COUNT
+      if (__builtin_cpu_supports("avx512bw"))
+	return AddAVX512;
+      if (__builtin_cpu_supports("avx2"))
+	return AddAVX2;
+#endif
+      return AddScalar;
+    }
+    if (strcmp(name, "scalar") == 0)
+      return AddScalar;
+#ifdef HAVE_SIMD_COUNT
+    if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2"))
+      return AddAVX2;
+    if (strcmp(name, "avx512") == 0 && __builtin_cpu_supports("avx512bw"))
+      return AddAVX512;
+#endif
+    return NULL;
+  }
 
-    EmitOp(0, OP_ADD);
-    EmitOp(1, OP_ROT); EmitRot(1, 2);
-    EmitOp(2, OP_XOR); SetBinopVars(2, 2, 0);
-    EmitOp(3, OP_ADD); SetBinopVars(3, 4, 0);
-    EmitOp(4, OP_ADD); SetBinopVars(4, 0, 3);
+  struct Result
+  {
+    int trials;
+    double maxBias;  // |2p - 1| of the worst (input, output) bit
+    int in, out;     // which
+    double chi2;     // per degree of freedom, 1 for a fair coin
+  };
 
-    const uint8_t shifts[] = { 32, 37, 27, 48, 5, 7, 50, 18, 9, 44, 14, 30, };
-    for (int iVar=0; iVar<_vars; ++iVar)
-      _s[iVar] = _s[iVar + _vars] = shifts[iVar];
+  Bias(int inputs, int outputs, func_t add)
+    : _inputs(inputs), _outputs(outputs), _add(add), _trials(0),
+      _bytes(inputs * outputs), _counts(inputs * outputs)
+  {
+    assert(outputs % 64 == 0);
   }
 
-  // generate a new function at random
-  void Generate()
+  // what flipping input bit "in" did to the outputs, outputs/64 words
+  void Add(int in, const uint64_t *diff)
   {
-    // We need to perfrom the following steps:
-    // -  s0 ?= data[0]   data injection
-    // -  s2 ?= s10       long-distance mix, s10 from the last iteration
-    // -  s0 = Rot64(s0)  permute after injection
-    // -  s11 ?= s0       mixing the data into the previous var
-    // -  s11 ?= s1       mix old next var into the previous var
+    _add(diff, _outputs / 64, &_bytes[in * _outputs]);
+  }
 
-    // Unlike in the original construction, ours is an early ROT.
-    int rotpos = 2;
-    EmitRot(rotpos, 0);
+  void EndTrial()
+  {
+    if (++_trials % 255 == 0)
+      Flush();
+  }
 
-    // Need at least one ADD/SUB and at least one XOR.
-    int addop = _r.Value() % MOD_BINOP;
-    int addpos = 0;
-    int xorpos = 1 + _r.Value() % (_ops - 2);
-    xorpos += (xorpos >= rotpos);
-    if (addop == OP_XOR) {
-      addpos = xorpos;
-      xorpos = 0;
-      addop = _r.Value() % MOD_ADDSUB;
+  Result Get()
+  {
+    Flush();
+    Result r = { _trials, 0, 0, 0, 0 };
+    double half = _trials / 2.0;
+    for (size_t i = 0; i < _counts.size(); i++)
+    {
+      double d = _counts[i] - half;
+      // both ways, flipped and not, each expected half the time
+      r.chi2 += 2 * d * d / half;
+      if (fabs(d) / half > r.maxBias)
+      {
+	r.maxBias = fabs(d) / half;
+	r.in = i / _outputs;
+	r.out = i % _outputs;
+      }
     }
-    EmitOp(addpos, addop);
-    EmitOp(xorpos, OP_XOR);
+    r.chi2 /= _counts.size();
+    return r;
+  }
 
-    // The rest are either ADD/SUB or XOR.
-    for (int iOp = 0; iOp < _ops; iOp++) {
-      if (iOp == addpos || iOp == xorpos || iOp == rotpos)
-	continue;
-      EmitOp(iOp, _r.Value() % MOD_BINOP);
-    }
+private:
+  void Flush()
+  {
+    for (size_t i = 0; i < _bytes.size(); i++)
+      _counts[i] += _bytes[i];
+    std::fill(_bytes.begin(), _bytes.end(), 0);
+  }
 
-    // Ops have been filled, connect vars to binops.
-    int iOp = 1;
-    iOp += (iOp == rotpos);
-    SetBinopVars(iOp++, 2, _vars - 2); // s2 ?= s10
-    iOp += (iOp == rotpos);
-    SetBinopVars(iOp++, _vars - 1, 0); // s11 ?= s0
-    iOp += (iOp == rotpos);
-    SetBinopVars(iOp++, _vars - 1, 1); // s11 ?= s1
+  static void AddScalar(const uint64_t *diff, int words, uint8_t *counts)
+  {
+    for (int w = 0; w < words; w++)
+      for (int j = 0; j < 64; j++)
+	counts[64*w + j] += (diff[w] >> j) & 1;
+  }
 
-    // Fill in the rotation constatns.
-    for (int iVar=0; iVar<_vars; ++iVar)
+#ifdef HAVE_SIMD_COUNT
+  // 32 bits at a time: spread each byte over 8 bytes, pick out
+  // a bit in each, and subtract the all-ones of the set ones.
+  __attribute__((target("avx2")))
+  static void AddAVX2(const uint64_t *diff, int words, uint8_t *counts)
+  {
+    const __m256i spread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+					    2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+    const __m256i bits = _mm256_set1_epi64x(0x8040201008040201ULL);
+    const uint32_t *d = (const uint32_t *) diff;
+    for (int i = 0; i < 2*words; i++)
     {
-      _s[iVar] = _s[iVar + _vars] = (_r.Value() % 65);
+      __m256i v = _mm256_shuffle_epi8(_mm256_set1_epi32(d[i]), spread);
+      v = _mm256_cmpeq_epi8(_mm256_and_si256(v, bits), bits);
+      __m256i *c = (__m256i *) (counts + 32*i);
+      _mm256_storeu_si256(c, _mm256_sub_epi8(_mm256_loadu_si256(c), v));
     }
   }
 
-  int Test()
+  // The bits are the mask of a masked add.
+  __attribute__((target("avx512f,avx512bw")))
+  static void AddAVX512(const uint64_t *diff, int words, uint8_t *counts)
   {
-    int minVal = INT_MAX;
-
-    for (int iVar=0; iVar<_vars; ++iVar)
+    const __m512i one = _mm512_set1_epi8(1);
+    for (int w = 0; w < words; w++)
     {
-      static const int tries = 5;
-      int try0[tries], try1[tries];
+      __m512i c = _mm512_loadu_si512(counts + 64*w);
+      c = _mm512_mask_add_epi8(c, (__mmask64) diff[w], c, one);
+      _mm512_storeu_si512(counts + 64*w, c);
+    }
+  }
+#endif
 
-      JitMixFunc Mix0(*this, 1, iVar);
-      int aVal0 = OneTest(Mix0);
-      if (aVal0 == 0) return 0;
-      try0[0] = aVal0;
+  int _inputs;     // bits
+  int _outputs;
+  func_t _add;
+  int _trials;
+  std::vector<uint8_t> _bytes;    // [in][out], since the last flush
+  std::vector<uint32_t> _counts;  // [in][out]
+};
 
-      JitMixFunc Mix1(*this, 0, iVar);
-      int aVal1 = OneTest(Mix1);
-      if (aVal1 == 0) return 0;
-      try1[0] = aVal1;
 
-      for (int i = 1; i < tries; i++) {
-	aVal0 = OneTest(Mix0);
-	if (aVal0 == 0) return 0;
-	try0[i] = aVal0;
-	aVal1 = OneTest(Mix1);
-	if (aVal1 == 0) return 0;
-	try1[i] = aVal1;
-      }
+// Times a piece of code in-process: the TSC, read with serializing
+// fences, and the cycles and instructions retired when the kernel
+// lets us have the hardware counters.
+class Bench
+{
+public:
+  struct Sample
+  {
+    uint64_t tsc;
+    uint64_t cycles;        // 0 without the hardware counters
+    uint64_t instructions;
+  };
 
-      std::sort(try0, try0 + tries);
-      std::sort(try1, try1 + tries);
+  Bench()
+  {
+    _cycles = _instructions = -1;
+#ifdef __linux__
+    _cycles = Open(PERF_COUNT_HW_CPU_CYCLES, -1);
+    if (_cycles >= 0)
+    {
+      _instructions = Open(PERF_COUNT_HW_INSTRUCTIONS, _cycles);
+      if (_instructions < 0)
+      {
+	close(_cycles);
+	_cycles = -1;
+      }
+    }
+#endif
+  }
 
-      // Robust estimate, ignore outliers at [0].
-      int e0 = (try0[1] + try0[2]) / 2;
-      int e1 = (try1[1] + try1[2]) / 2;
-      minVal = std::min(minVal, e0);
-      minVal = std::min(minVal, e1);
+  ~Bench()
+  {
+    if (_cycles >= 0)
+    {
+      close(_instructions);
+      close(_cycles);
     }
-    printf("// minVal = %d\n", minVal);
-    return 1;
   }
 
-  void Pre()
+  bool HaveCounters() const
   {
-    fprintf(_fp, "#include <stdio.h>\n");
-    fprintf(_fp, "#include <stdint.h>\n");
-    fprintf(_fp, "\n");
-    fprintf(_fp, "#define VAR %d\n", _vars);
-    fprintf(_fp, "#define ITERS (100000000)\n");
-    fprintf(_fp, "#define CUT 4000\n");
-    fprintf(_fp, "#define Rot64(x,k) (((x)<<(k)) | ((x)>>(64-(k))))\n");
-    fprintf(_fp, "\n");
+    return _cycles >= 0;
   }
 
-  // print the function in C++ code
-  void ReportCode(int version)
+  void Start()
   {
-    fprintf(_fp, "void function%d(uint64_t *data, uint64_t *state)\n", version);
-    fprintf(_fp, "{\n");
-    
-    for (int iVar=0; iVar<_vars; ++iVar)
+#ifdef __linux__
+    if (_cycles >= 0)
     {
-      fprintf(_fp, "    uint64_t s%d = state[%d];\n", iVar, iVar);
+      ioctl(_cycles, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+      ioctl(_cycles, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
     }
+#endif
+    _tsc = StartTSC();
+  }
 
-    for (int iIter=0; iIter<_iters; ++iIter)
+  Sample Stop()
+  {
+    Sample sample;
+    sample.tsc = StopTSC() - _tsc;
+    sample.cycles = sample.instructions = 0;
+#ifdef __linux__
+    if (_cycles >= 0)
     {
-      for (int iVar=0; iVar<_vars; ++iVar)
+      ioctl(_cycles, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+      uint64_t buf[3];  // nr, then the values
+      if (read(_cycles, buf, sizeof buf) == sizeof buf)
       {
-	const char opc[] = "+-^????";
-	fprintf(_fp, "    s%d %c= data[%d];", iVar, opc[_op[0]], iVar);
-	for (int iOp=1; iOp<_ops; ++iOp)
-	{
-	  PrintOp(_fp, _op[iOp], 
-		  (_v1[iOp] + iVar) % _vars, 
-		  (_v2[iOp] + iVar) % _vars, 
-		  _s[iVar]);
-	}
-	fprintf(_fp, "\n");
+	sample.cycles = buf[1];
+	sample.instructions = buf[2];
       }
     }
-    
-    for (int iVar=0; iVar<_vars; ++iVar)
-    {
-      fprintf(_fp, "    state[%d] = s%d;\n", iVar, iVar);
-    }
-
-    fprintf(_fp, "}\n");
-    fprintf(_fp, "\n");
-    fprintf(_fp, "void wrapper%d(uint64_t *data, uint64_t *state)\n", version);
-    fprintf(_fp, "{\n");
-    fprintf(_fp, "  uint64_t a = GetTickCount();\n");
-    fprintf(_fp, "  for (int i=0; i<ITERS; ++i) {\n");
-    fprintf(_fp, "    function%d(data, state);\n", version);
-    fprintf(_fp, "  }\n");
-    fprintf(_fp, "  uint64_t z = GetTickCount();\n");
-    fprintf(_fp, "  if (z-a < CUT) {\n");
-    fprintf(_fp, "    printf(\"");
-    ReportStructure(version);
-    fprintf(_fp, "  %%lld\\n\", z-a);\n");
-    fprintf(_fp, "  }\n");
-    fprintf(_fp, "}\n");
-    fprintf(_fp, "\n");
+#endif
+    return sample;
   }
 
-  void ReportStructure(int version)
+private:
+#ifdef __linux__
+  static int Open(uint64_t config, int group)
   {
-    for (int iOp=0; iOp<_ops; ++iOp)
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof attr);
+    attr.size = sizeof attr;
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = (group < 0);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+  }
+#endif
+
+  // Fences keep the code being timed from leaking out of the interval.
+  static inline uint64_t StartTSC()
+  {
+#ifdef HAVE_SIMD_COUNT
+    _mm_lfence();
+    uint64_t t = __rdtsc();
+    _mm_lfence();
+    return t;
+#else
+    return 0;
+#endif
+  }
+
+  static inline uint64_t StopTSC()
+  {
+#ifdef HAVE_SIMD_COUNT
+    unsigned aux;
+    uint64_t t = __rdtscp(&aux);
+    _mm_lfence();
+    return t;
+#else
+    return 0;
+#endif
+  }
+
+  int _cycles;        // group leader
+  int _instructions;
+  uint64_t _tsc;
+};
+
+
+// Data to stream through the candidates, up to gigabytes of it, so
+// that long messages are timed from memory rather than the cache.
+// Huge pages keep the TLB misses out of the figures: reserved ones
+// if the system has them, else transparent ones if it will give them.
+class Buffer
+{
+public:
+  Buffer(size_t bytes)
+  {
+    static const size_t _huge = 2 << 20;
+    _bytes = (bytes + _huge - 1) & ~(_huge - 1);
+    _pages = "huge";
+    _data = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    _data = mmap(NULL, _bytes, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (_data == MAP_FAILED)
     {
-      fprintf(_fp, "%1d %2d %2d ", _op[iOp], _v1[iOp], _v2[iOp]);
+      _pages = "4K";
+      _data = mmap(NULL, _bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (_data == MAP_FAILED)
+      {
+	perror("mmap");
+	exit(1);
+      }
+#ifdef MADV_HUGEPAGE
+      if (madvise(_data, _bytes, MADV_HUGEPAGE) == 0)
+	_pages = "transparent huge";
+#endif
     }
-    fprintf(_fp, " ");
+    // touch every page, so that no faults are timed
+    uint64_t *data = (uint64_t *) _data;
+    for (size_t i=0; i<_bytes/8; ++i)
+      data[i] = i * 0x9e3779b97f4a7c15ULL;
+  }
+
+  ~Buffer()
+  {
+    munmap(_data, _bytes);
+  }
+
+  const uint64_t *Data() const
+  {
+    return (const uint64_t *) _data;
+  }
+  size_t Bytes() const
+  {
+    return _bytes;
+  }
+  // what backs the buffer: huge, transparent huge or 4K pages
+  const char *Pages() const
+  {
+    return _pages;
+  }
+
+private:
+  void *_data;
+  size_t _bytes;
+  const char *_pages;
+};
+
+
+// Where the time goes, phase by phase, and where in the (measure, iBit)
+// space the candidates fail.  Each worker keeps its own and hands it to
+// the driver along with each verdict, so nothing is shared while testing.
+// The timers are not fenced, they are for the big picture only.
+class Stats
+{
+public:
+  enum Phase { GENERATE, PREDICT, COMPILE, PATCH, SETUP, MIX, COUNT, SPEED, BIAS, PHASES };
+  static const int _measures = Counter::_measures;
+
+  uint64_t calls[PHASES];
+  uint64_t ticks[PHASES];
+  uint64_t fail[_measures][64];  // by measure and iBit, see Sieve::OneTest()
+
+  Stats()
+  {
+    Clear();
+  }
+
+  void Clear()
+  {
+    memset(this, 0, sizeof *this);
+  }
+
+  void Add(const Stats& other)
+  {
+    for (int i = 0; i < PHASES; i++)
+    {
+      calls[i] += other.calls[i];
+      ticks[i] += other.ticks[i];
+    }
+    for (int i = 0; i < _measures; i++)
+      for (int j = 0; j < 64; j++)
+	fail[i][j] += other.fail[i][j];
+  }
+
+  static const char *Name(int phase)
+  {
+    static const char *names[PHASES] = {
+      "generate", "predict", "compile", "patch", "setup", "mix", "count", "speed", "bias",
+    };
+    return names[phase];
+  }
+
+  // TSC ticks, or nanoseconds where there is no TSC
+  static const char *Clock()
+  {
+#ifdef HAVE_SIMD_COUNT
+    return "tsc";
+#else
+    return "ns";
+#endif
+  }
+
+  static inline uint64_t Now()
+  {
+#ifdef HAVE_SIMD_COUNT
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+  }
+
+  // Count the time since start, and return the time now.
+  uint64_t Lap(Phase phase, uint64_t start)
+  {
+    uint64_t now = Now();
+    calls[phase]++;
+    ticks[phase] += now - start;
+    return now;
+  }
+
+  // Times the rest of the scope.
+  class Timer
+  {
+  public:
+    Timer(Stats& stats, Phase phase) : _stats(stats), _phase(phase), _start(Now()) {}
+    ~Timer()
+    {
+      _stats.calls[_phase]++;
+      _stats.ticks[_phase] += Now() - _start;
+    }
+  private:
+    Stats& _stats;
+    Phase _phase;
+    uint64_t _start;
+  };
+};
+
+
+// The candidates that no other candidate beats on both avalanche
+// (minVal, higher is better) and speed (cycles per block, lower is
+// better), kept in the order of speed.  Workers consult the front
+// while the reporter updates it, hence the lock.
+class Front
+{
+public:
+  struct Entry
+  {
+    int minVal;
+    double cycles;
+    uint64_t index;  // which candidate
+  };
+
+  // a is at least as good as b on both counts, and better on one
+  static bool Dominates(const Entry& a, int minVal, double cycles)
+  {
+    return a.minVal >= minVal && a.cycles <= cycles &&
+      (a.minVal > minVal || a.cycles < cycles);
+  }
+
+  bool Dominated(int minVal, double cycles)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (size_t i=0; i<_front.size(); ++i)
+      if (Dominates(_front[i], minVal, cycles))
+	return true;
+    return false;
+  }
+
+  // Returns false if the entry is dominated; otherwise, it goes in,
+  // and the entries it dominates are dropped.
+  bool Add(const Entry& e)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (size_t i=0; i<_front.size(); ++i)
+      if (Dominates(_front[i], e.minVal, e.cycles))
+	return false;
+    std::vector<Entry> front;
+    for (size_t i=0; i<_front.size(); ++i)
+      if (!Dominates(e, _front[i].minVal, _front[i].cycles))
+	front.push_back(_front[i]);
+    front.push_back(e);
+    std::sort(front.begin(), front.end(), [](const Entry& a, const Entry& b)
+	      { return a.cycles < b.cycles; });
+    _front.swap(front);
+    return true;
+  }
+
+  std::vector<Entry> Get()
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _front;
+  }
+
+private:
+  std::mutex _mutex;
+  std::vector<Entry> _front;
+};
+
+
+// Rough costs of the instructions a Mix is made of, enough to predict
+// its speed, after Agner Fog's instruction tables.  A Feed is a load
+// micro-fused with an ALU op; the load does not depend on the state,
+// so only the ALU latency is on the dependency chain.
+struct Uarch
+{
+  const char *name;
+  int width;       // uops issued per cycle
+  int alus;        // ports that do ADD/SUB/XOR
+  int rotPorts;    // of those, ports that do ROL
+  int loadPorts;
+  int latRot;      // ADD/SUB/XOR are 1 cycle everywhere
+  int latBswap;
+  int uopsBswap;   // BSWAP r64 takes a rotate port, and maybe another ALU
+
+  static const Uarch *Find(const char *name)
+  {
+    static const Uarch table[] = {
+      { "skylake",   4, 4, 2, 2, 1, 2, 2 },
+      { "icelake",   5, 4, 2, 2, 1, 2, 2 },
+      { "zen2",      5, 4, 2, 2, 1, 1, 1 },
+      { "zen4",      6, 4, 2, 3, 1, 1, 1 },
+    };
+    for (size_t i=0; i<sizeof table / sizeof *table; ++i)
+      if (strcmp(table[i].name, name) == 0)
+	return &table[i];
+    return NULL;
+  }
+};
+
+
+// random number generator
+class Random : UInt64Helper
+{ 
+public:
+    inline uint64_t Value()
+    {
+        uint64_t e = m_a - Rot64(m_b, 23);
+        m_a = m_b ^ Rot64(m_c, 16);
+        m_b = m_c + Rot64(m_d, 11);
+        m_c = m_d + e;
+        m_d = e + m_a;
+        return m_d;
+    }
+
+    inline void Init( uint64_t seed)
+    {
+        m_a = 0xdeadbeef; 
+        m_b = m_c = m_d = seed;
+        for (int i=0; i<20; ++i) 
+            (void)Value();
+    }
+
+private:
+    uint64_t m_a;
+    uint64_t m_b;
+    uint64_t m_c;
+    uint64_t m_d;
+};
+
+
+// perf keeps one name per address in /tmp/perf-PID.map, and the arena
+// puts every candidate at the same addresses, so the functions are named
+// there without the candidate, see JitMixFunc::Name()
+static bool perfMap;
+
+// generate, test, and report mixing functions
+class Sieve : UInt64Helper
+{
+  static const int _maxVars = 32;
+  static const int _ops = 5;
+
+  enum OP_e { OP_ADD, OP_SUB, OP_XOR, OP_ROT };
+  enum { MOD_ADDSUB = OP_XOR, MOD_BINOP = OP_ROT };
+
+  class JitMixFunc;
+  class MixSet;
+
+  inline void EmitOp(int iOp, int OP)
+  {
+    _op[iOp] = OP;
+  }
+  inline void SetBinopVars(int iOp, int L, int R)
+  {
+    assert(_op[iOp] < MOD_BINOP);
+    _v1[iOp] = L;
+    _v2[iOp] = R;
+  }
+  inline void EmitRot(int iOp, int LR)
+  {
+    _op[iOp] = OP_ROT;
+    _v1[iOp] = _v2[iOp] = LR;
+  }
+
+public:
+  // everything that Generate() decides about a function
+  struct Structure
+  {
+    int op[_ops];
+    int v1[_ops];
+    int v2[_ops];
+    int s[2*_maxVars];
+  };
+
+  Sieve(uint64_t seed, FILE *fp)
+  {
+    _r.Init(seed);
+    _fp = fp;
+    _log = stdout;
+    _vars = 12;
+    _lanes = 1;
+    _unroll = 1;
+    _iters = 1;
+    _count = Counter::Select(NULL);
+    _biasTrials = 0;
+    _biasAdd = Bias::Select(NULL);
+    _prefetch = 0;
+    _buffer = NULL;
+    _index = -1;
+    _cyclesPerByte = 0;
+    _showSpeed = false;
+    _patchable = false;
+    _cyclesPerBlock = 0;
+    _front = NULL;
+    _failCounter = 0;
+    _failCell = -1;
+    _minVal = 0;
+    _uarch = Uarch::Find("skylake");
+    _arena = jit_arena_new();
+    _mix = NULL;
+  }
+
+  ~Sieve()
+  {
+    delete _mix;
+    delete _buffer;
+    jit_arena_free(_arena);
+  }
+
+  // Load one of the tables of mix.h, so the JIT and the compiler work
+  // from the same constants.  The ops of both are in the same order.
+  template <class T> void PreloadTable()
+  {
+    assert(_ops == 5);
+    assert(_vars == T::vars);
+    static_assert((int) mix::ADD == OP_ADD && (int) mix::SUB == OP_SUB &&
+		  (int) mix::XOR == OP_XOR && (int) mix::ROT == OP_ROT, "mix::Op differs");
+
+    EmitOp(0, T::op[0]);
+    for (int iOp=1; iOp<_ops; ++iOp)
+    {
+      if (T::op[iOp] == mix::ROT)
+	EmitRot(iOp, T::v1[iOp]);
+      else
+      {
+	EmitOp(iOp, T::op[iOp]);
+	SetBinopVars(iOp, T::v1[iOp], T::v2[iOp]);
+      }
+    }
+
     for (int iVar=0; iVar<_vars; ++iVar)
+      _s[iVar] = _s[iVar + _vars] = T::s[iVar];
+  }
+
+  // Restore to the original SpookyMix function.
+  void PreloadSpooky()
+  {
+    PreloadTable<mix::Spooky>();
+  }
+
+  // Examine the mixing function from SpookyAlpha.
+  void PreloadAlpha()
+  {
+    PreloadTable<mix::Alpha>();
+  }
+
+  // Another Bob's brainchild was AkronHash.
+  void PreloadAkron()
+  {
+    PreloadTable<mix::Akron>();
+  }
+
+  // The width of the state, in 64-bit words.  Must be set before
+  // anything is generated or loaded.
+  void SetVars(int vars)
+  {
+    assert(vars >= 4 && vars <= _maxVars);
+    _vars = vars;
+    _pairs.clear();
+  }
+
+  // The order in which OneTest() goes through the cells of 64 pairs,
+  // cell iBit*vars + iBit2/64, the ones likely to fail first; or NULL
+  // for iBit by iBit.  The verdict is the same either way, only
+  // reached sooner (see the Driver).
+  void SetOrder(const std::shared_ptr<const std::vector<int> >& order)
+  {
+    assert(!order || order->size() == (size_t) 64*_vars);
+    if (order == _order)
+      return;
+    _order = order;
+    _pairs.clear();
+  }
+
+  // The cell of the pair that failed the last candidate, or -1.
+  int FailCell() const
+  {
+    return _failCell;
+  }
+
+  // Mix each block for several rounds.
+  void SetIters(int iters)
+  {
+    _iters = iters;
+  }
+
+  // Unroll the Mix loop, so that a trip through it handles several blocks.
+  void SetUnroll(int unroll)
+  {
+    _unroll = unroll;
+  }
+
+  // One of the cheap screens that run before the full Test().
+  struct Stage
+  {
+    int step;        // try every step-th iBit2, or only iBit2 = iBit if 0
+    bool forward;    // only the forward direction
+    double budget;   // if > 0, reject on Predict() alone, see below
+  };
+
+  // what Predict() thinks of the candidate, in cycles per block
+  struct Prediction
+  {
+    double latency;  // the critical path through the state
+    double ports;    // the busiest port, or the issue width
+    double cycles;   // the larger of the two
+    double ipc;
+  };
+
+  // The machine that Predict() models.
+  void SetUarch(const Uarch *uarch)
+  {
+    _uarch = uarch;
+  }
+
+  // How fast the scalar forward Mix could run, from the structure
+  // alone.  The state is carried through enough blocks for the chain
+  // that repeats from block to block to settle, then measured over
+  // the second half of them.
+  Prediction Predict() const
+  {
+    static const int _blocks = 16;
+    const Uarch& u = *_uarch;
+    int ready[_maxVars] = {};  // when each var is computed
+    int alu = 0, rot = 0, loads = 0, uops = 0, insns = 0;
+    int half = 0;
+
+    for (int iBlock=0; iBlock<_blocks; ++iBlock)
     {
-      fprintf(_fp, "%2d ", _s[iVar]);
+      if (iBlock == _blocks/2)
+	half = *std::max_element(ready, ready + _vars);
+      for (int iIter=0; iIter<_iters; ++iIter)
+      {
+	for (int iVar=0; iVar<_vars; ++iVar)
+	{
+	  ready[iVar] += 1;   // Feed
+	  for (int iOp=1; iOp<_ops; ++iOp)
+	  {
+	    int dst = (_v1[iOp] + iVar) % _vars;
+	    int src = (_v2[iOp] + iVar) % _vars;
+	    if (_op[iOp] != OP_ROT)
+	      ready[dst] = std::max(ready[dst], ready[src]) + 1;
+	    else if (_s[iVar] % 64 == 0)
+	      ready[dst] += u.latBswap;
+	    else
+	      ready[dst] += u.latRot;
+	  }
+	}
+      }
+    }
+
+    // the ports, for a single block
+    for (int iIter=0; iIter<_iters; ++iIter)
+    {
+      for (int iVar=0; iVar<_vars; ++iVar)
+      {
+	alu++, loads++, uops++, insns++;  // Feed
+	for (int iOp=1; iOp<_ops; ++iOp)
+	{
+	  insns++;
+	  if (_op[iOp] != OP_ROT)
+	    alu++, uops++;
+	  else if (_s[iVar] % 64 == 0)
+	    alu += u.uopsBswap, rot++, uops += u.uopsBswap;
+	  else
+	    alu++, rot++, uops++;
+	}
+      }
+    }
+
+    Prediction pred;
+    pred.latency = (double) (*std::max_element(ready, ready + _vars) - half) / (_blocks - _blocks/2);
+    pred.ports = std::max(std::max((double) alu / u.alus, (double) rot / u.rotPorts),
+			  std::max((double) loads / u.loadPorts, (double) uops / u.width));
+    pred.cycles = std::max(pred.latency, pred.ports);
+    pred.ipc = insns / pred.cycles;
+    return pred;
+  }
+
+  void SetCascade(const std::vector<Stage>& cascade)
+  {
+    _cascade = cascade;
+  }
+
+  // Only look for candidates that make it onto the front.  Those that
+  // fall behind it are dropped as soon as it shows: minVal only goes
+  // down as Test() goes on, so they cannot get back onto the front.
+  void SetFront(Front *front)
+  {
+    _front = front;
+  }
+
+  // how OneTest() counts the affected bits
+  void SetCounter(Counter::func_t count)
+  {
+    _count = count;
+  }
+
+  // Work out the full avalanche matrix of each candidate that passes,
+  // over so many trials (0 for none), see BiasTest().
+  void SetBias(int trials, Bias::func_t add)
+  {
+    _biasTrials = trials;
+    _biasAdd = add;
+  }
+
+  // Time each function that is reported streaming over buffers of
+  // these sizes (none for no timing), with the data prefetched so
+  // many bytes ahead (0 for none), see Throughput().
+  void SetStream(const std::vector<size_t>& sizes, int prefetch)
+  {
+    _streamSizes = sizes;
+    _prefetch = prefetch;
+  }
+
+  // Report the measured speed of each candidate that passes, see Speed().
+  // The output then differs from run to run.
+  void SetShowSpeed(bool show)
+  {
+    _showSpeed = show;
+  }
+
+  // Compile the rotations so they can be patched, for runs whose
+  // candidates mostly differ from the one before only in those.  The
+  // patchable forms are slower, so this is off by default.
+  void SetPatchable(bool patchable)
+  {
+    _patchable = patchable;
+  }
+
+  // Mix several blocks at once with vector instructions.
+  void SetLanes(int lanes)
+  {
+    _lanes = lanes;
+  }
+
+  // Each candidate draws from its own random stream, so that the outcome
+  // does not depend on which thread gets to test it, or in which order.
+  void Seed(uint64_t seed, uint64_t index)
+  {
+    _r.Init(seed ^ (index * 0x9e3779b97f4a7c15ULL));
+    _index = index;
+  }
+
+  // where the "// fail" and "// minVal" diagnostics go
+  void SetLog(FILE *log)
+  {
+    _log = log;
+  }
+  FILE *Log() const
+  {
+    return _log;
+  }
+
+  // Collect the stats so far, and start over.
+  void TakeStats(Stats& total)
+  {
+    total.Add(_stats);
+    _stats.Clear();
+  }
+
+  Stats& GetStats()
+  {
+    return _stats;
+  }
+
+  void Save(Structure& st) const
+  {
+    std::copy(_op, _op + _ops, st.op);
+    std::copy(_v1, _v1 + _ops, st.v1);
+    std::copy(_v2, _v2 + _ops, st.v2);
+    std::copy(_s, _s + 2*_vars, st.s);
+  }
+
+  void Load(const Structure& st)
+  {
+    std::copy(st.op, st.op + _ops, _op);
+    std::copy(st.v1, st.v1 + _ops, _v1);
+    std::copy(st.v2, st.v2 + _ops, _v2);
+    std::copy(st.s, st.s + 2*_vars, _s);
+  }
+
+  // Two structures that only differ in ways Test() cannot see get the
+  // same key:
+  // - Rot64 by 64 is BSWAP, the same as by 0.
+  // - Test() tries every start, i.e. every cyclic shift of the
+  //   rotation constants, so the shifts only matter up to a cycle.
+  // - Adjacent ops commute if neither touches what the other one
+  //   writes; so do two ADD/SUBs, or two XORs, into the same var,
+  //   from other vars.
+  // Swapping ADD and SUB, or relabeling the vars, generally does not
+  // give the same function, and is not attempted.
+  uint64_t Key() const
+  {
+    // the least cyclic shift of the rotation constants
+    int s[_maxVars], best[_maxVars];
+    for (int iVar=0; iVar<_vars; ++iVar)
+      s[iVar] = _s[iVar] % 64;
+    std::copy(s, s + _vars, best);
+    for (int k=1; k<_vars; ++k)
+    {
+      int t[_maxVars];
+      std::rotate_copy(s, s + k, s + _vars, t);
+      if (std::lexicographical_compare(t, t + _vars, best, best + _vars))
+	std::copy(t, t + _vars, best);
+    }
+
+    // FNV-1a, good enough for a few billion structures
+    uint64_t h = 0xcbf29ce484222325ULL;
+    std::vector<int> least = Ops();
+    least.insert(least.end(), best, best + _vars);
+    for (size_t i=0; i<least.size(); ++i)
+    {
+      h ^= (uint64_t) least[i];
+      h *= 0x100000001b3ULL;
+    }
+    return h;
+  }
+
+  // The ops and their vars in canonical form, see Key(): op 0, which is
+  // always the data injection, then the least order of ops 1.._ops-1,
+  // as (op, v1, v2) triples, that the swaps can reach.
+  std::vector<int> Ops() const
+  {
+    typedef std::vector<int> Order;
+    Order start;
+    for (int iOp=1; iOp<_ops; ++iOp)
+    {
+      start.push_back(_op[iOp]);
+      start.push_back(_v1[iOp]);
+      start.push_back(_v2[iOp]);
+    }
+    std::vector<Order> seen(1, start), todo(1, start);
+    Order least = start;
+    while (!todo.empty())
+    {
+      Order o = todo.back();
+      todo.pop_back();
+      least = std::min(least, o);
+      for (size_t i=0; i+3<o.size(); i+=3)
+      {
+	if (!Commute(&o[i], &o[i+3]))
+	  continue;
+	Order n = o;
+	std::swap_ranges(&n[i], &n[i+3], &n[i+3]);
+	if (std::find(seen.begin(), seen.end(), n) == seen.end())
+	{
+	  seen.push_back(n);
+	  todo.push_back(n);
+	}
+      }
+    }
+    least.insert(least.begin(), _op[0]);
+    return least;
+  }
+
+  // Every structure of ops that Generate() can come up with, one of
+  // each set of equivalent ones, in canonical order.  The vars of the
+  // binops are fixed, so only the kinds of ops vary: ADD, SUB or XOR
+  // in every position but the early ROT, with at least one ADD/SUB and
+  // at least one XOR.  The rotation constants are left for Rotate().
+  std::vector<Structure> Enumerate()
+  {
+    static const int rotpos = 2;
+    std::map<std::vector<int>, Structure> found;
+    int npos = _ops - 1;
+    int ncombo = 1;
+    for (int i=0; i<npos; ++i)
+      ncombo *= MOD_BINOP;
+    for (int combo=0; combo<ncombo; ++combo)
+    {
+      bool addsub = false, xxor = false;
+      for (int iOp=0, c=combo; iOp<_ops; ++iOp)
+      {
+	if (iOp == rotpos)
+	{
+	  EmitRot(iOp, 0);
+	  continue;
+	}
+	EmitOp(iOp, c % MOD_BINOP);
+	c /= MOD_BINOP;
+	if (_op[iOp] == OP_XOR)
+	  xxor = true;
+	else
+	  addsub = true;
+      }
+      if (!addsub || !xxor)
+	continue;
+      ConnectBinops(rotpos);
+      Structure st;
+      std::fill(_s, _s + 2*_vars, 0);
+      Save(st);
+      found.insert(std::make_pair(Ops(), st));
+    }
+    std::vector<Structure> list;
+    for (std::map<std::vector<int>, Structure>::iterator it = found.begin(); it != found.end(); ++it)
+      list.push_back(it->second);
+    return list;
+  }
+
+  // Draw the rotation constants, for a given structure of ops.
+  void Rotate()
+  {
+    for (int iVar=0; iVar<_vars; ++iVar)
+    {
+      _s[iVar] = _s[iVar + _vars] = (_r.Value() % 65);
+    }
+  }
+
+  // generate a new function at random
+  void Generate()
+  {
+    // We need to perfrom the following steps:
+    // -  s0 ?= data[0]   data injection
+    // -  s2 ?= s10       long-distance mix, s10 from the last iteration
+    // -  s0 = Rot64(s0)  permute after injection
+    // -  s11 ?= s0       mixing the data into the previous var
+    // -  s11 ?= s1       mix old next var into the previous var
+
+    // Unlike in the original construction, ours is an early ROT.
+    int rotpos = 2;
+    EmitRot(rotpos, 0);
+
+    // Need at least one ADD/SUB and at least one XOR.
+    int addop = _r.Value() % MOD_BINOP;
+    int addpos = 0;
+    int xorpos = 1 + _r.Value() % (_ops - 2);
+    xorpos += (xorpos >= rotpos);
+    if (addop == OP_XOR) {
+      addpos = xorpos;
+      xorpos = 0;
+      addop = _r.Value() % MOD_ADDSUB;
+    }
+    EmitOp(addpos, addop);
+    EmitOp(xorpos, OP_XOR);
+
+    // The rest are either ADD/SUB or XOR.
+    for (int iOp = 0; iOp < _ops; iOp++) {
+      if (iOp == addpos || iOp == xorpos || iOp == rotpos)
+	continue;
+      EmitOp(iOp, _r.Value() % MOD_BINOP);
+    }
+
+    // Ops have been filled, connect vars to binops.
+    ConnectBinops(rotpos);
+
+    // Fill in the rotation constatns.
+    Rotate();
+  }
+
+  // Everything the compiled Mix depends on, but the shift constants.
+  std::vector<int> Shape() const
+  {
+    std::vector<int> shape(_op, _op + _ops);
+    shape.insert(shape.end(), _v1, _v1 + _ops);
+    shape.insert(shape.end(), _v2, _v2 + _ops);
+    shape.push_back(_vars);
+    shape.push_back(_lanes);
+    shape.push_back(_unroll);
+    shape.push_back(_iters);
+    return shape;
+  }
+
+  int Test()
+  {
+    _dominated = false;
+    _failCounter = 0;
+    _failCell = -1;
+
+    // Predictions need no code, and come first in the cascade.
+    size_t iStage = 0;
+    for (; iStage<_cascade.size() && _cascade[iStage].budget > 0; ++iStage)
+    {
+      _rejected = iStage;
+      Stats::Timer timer(_stats, Stats::PREDICT);
+      if (Predict().cycles > _cascade[iStage].budget)
+	return 0;
+    }
+
+    // All the variants go into the arena, and become executable at once.
+    // If only the shift constants differ from the last candidate, as in
+    // the enumeration and in the annealing, the code is patched instead.
+    std::vector<int> shape = Shape();
+    if (_mix && _patchable && shape == _mixShape)
+    {
+      Stats::Timer timer(_stats, Stats::PATCH);
+      jit_arena_unseal(_arena);
+      _mix->Retune(*this);
+    }
+    else
+    {
+      Stats::Timer timer(_stats, Stats::COMPILE);
+      delete _mix;
+      jit_arena_reset(_arena);
+      _mix = new MixSet(*this, _arena);
+      _mixShape = shape;
+    }
+    jit_arena_seal(_arena);
+    MixSet& Mix = *_mix;
+
+    // Most candidates fail early, so run the cheap screens first.
+    for (; iStage<_cascade.size(); ++iStage)
+    {
+      _rejected = iStage;
+      if (!Screen(Mix, _cascade[iStage]))
+	return 0;
+    }
+    _rejected = _cascade.size();
+
+    int minVal = INT_MAX;
+    if (_front)
+      Speed();
+
+    for (int iVar=0; iVar<_vars; ++iVar)
+    {
+      static const int tries = 5;
+      int try0[tries], try1[tries];
+
+      JitMixFunc& Mix0 = Mix(1, iVar);
+      int aVal0 = OneTest(Mix0);
+      if (aVal0 == 0) return 0;
+      try0[0] = aVal0;
+
+      JitMixFunc& Mix1 = Mix(0, iVar);
+      int aVal1 = OneTest(Mix1);
+      if (aVal1 == 0) return 0;
+      try1[0] = aVal1;
+
+      for (int i = 1; i < tries; i++) {
+	aVal0 = OneTest(Mix0);
+	if (aVal0 == 0) return 0;
+	try0[i] = aVal0;
+	aVal1 = OneTest(Mix1);
+	if (aVal1 == 0) return 0;
+	try1[i] = aVal1;
+      }
+
+      std::sort(try0, try0 + tries);
+      std::sort(try1, try1 + tries);
+
+      // Robust estimate, ignore outliers at [0].
+      int e0 = (try0[1] + try0[2]) / 2;
+      int e1 = (try1[1] + try1[2]) / 2;
+      minVal = std::min(minVal, e0);
+      minVal = std::min(minVal, e1);
+      if (_front && _front->Dominated(minVal, _cyclesPerBlock))
+      {
+	fprintf(_log, "// dominated at minVal = %d\n", minVal);
+	_dominated = true;
+	return 0;
+      }
+    }
+    if (!_front)
+      Speed();
+    _minVal = minVal;
+    fprintf(_log, "// minVal = %d\n", minVal);
+    // the timings differ from run to run, so only if asked for
+    if (_showSpeed && _speed.cycles)
+      fprintf(_log, "// speed: %.3f cycles/byte, %.2f insns/cycle\n",
+	      _cyclesPerByte, (double) _speed.instructions / _speed.cycles);
+    else if (_showSpeed)
+      fprintf(_log, "// speed: %.3f TSC ticks/byte\n", _cyclesPerByte);
+    if (_biasTrials)
+    {
+      Bias::Result bias = BiasTest(Mix(1, 0));
+      fprintf(_log, "// bias over %d trials: max %.4f, data bit %d to state bit %d, chi2/df %.3f\n",
+	      bias.trials, bias.maxBias, bias.in, bias.out, bias.chi2);
+    }
+    Prediction pred = Predict();
+    fprintf(_log, "// predicted on %s: %.2f cycles/block, latency %.2f, ports %.2f, IPC %.2f\n",
+	    _uarch->name, pred.cycles, pred.latency, pred.ports, pred.ipc);
+    _rejected = -1;
+    return 1;
+  }
+
+  // Time the scalar forward Mix, the way the hash would run it: one
+  // state, fed with consecutive blocks of data.  Warm up, then take the
+  // median of several runs.
+  void Speed()
+  {
+    static const int _blocks = 1024;
+    static const int _warmup = 2;
+    static const int _runs = 9;
+    // filled once, before any worker gets to read it
+    static const std::vector<uint64_t> data = SpeedData(_blocks*_maxVars);
+    uint64_t state[_maxVars] = {};
+
+    Stats::Timer timer(_stats, Stats::SPEED);
+    JitMixFunc Mix(*this, 1, 0, NULL, true);
+    Bench::Sample runs[_runs];
+    for (int iRun=-_warmup; iRun<_runs; ++iRun)
+    {
+      _bench.Start();
+      Mix.Stream(state, &data[0], _blocks);
+      Bench::Sample sample = _bench.Stop();
+      if (iRun >= 0)
+	runs[iRun] = sample;
+    }
+    // by cycles only if every run has them, so the order is consistent
+    bool byCycles = std::all_of(runs, runs + _runs, [](const Bench::Sample& a) { return a.cycles != 0; });
+    std::sort(runs, runs + _runs, [byCycles](const Bench::Sample& a, const Bench::Sample& b)
+	      { return byCycles ? a.cycles < b.cycles : a.tsc < b.tsc; });
+    _speed = runs[_runs/2];
+    if (!byCycles)
+      _speed.cycles = 0;
+    uint64_t cycles = _speed.cycles ? _speed.cycles : _speed.tsc;
+    _cyclesPerBlock = (double) cycles / _blocks;
+    _cyclesPerByte = _cyclesPerBlock / (8*_vars);
+  }
+
+  // A stream function compiled ahead of time, see mix.h.
+  typedef void (*stream_t)(uint64_t *state, const uint64_t *data, size_t blocks);
+
+  // Time the scalar forward Mix streaming over a long message, for
+  // each of the sizes given to SetStream(), and report the GB/s.  With
+  // the same function as compiled by the C++ compiler, which must agree,
+  // time that too.
+  void Throughput(const char *name, stream_t compiled = NULL)
+  {
+    if (_streamSizes.empty())
+      return;
+    size_t granule = 8*_vars*_unroll;
+    size_t most = *std::max_element(_streamSizes.begin(), _streamSizes.end());
+    if (_buffer == NULL || _buffer->Bytes() < std::max(most, granule))
+    {
+      delete _buffer;
+      _buffer = new Buffer(std::max(most, granule));
+    }
+    const uint64_t *data = _buffer->Data();
+
+    JitMixFunc Mix(*this, 1, 0, NULL, true, false, _prefetch);
+    char label[64];
+    snprintf(label, sizeof label, "%s over %s pages", name, _buffer->Pages());
+    Rates(label, [&](uint64_t *state, size_t blocks) { Mix.Stream(state, data, blocks); });
+    if (compiled)
+    {
+      uint64_t a[_maxVars] = {}, b[_maxVars] = {};
+      size_t blocks = std::min(_buffer->Bytes() / granule, (size_t) 64) * _unroll;
+      Mix.Stream(a, data, blocks);
+      compiled(b, data, blocks);
+      assert(memcmp(a, b, 8*_vars) == 0);
+      snprintf(label, sizeof label, "%s compiled by C++", name);
+      Rates(label, [&](uint64_t *state, size_t blocks) { compiled(state, data, blocks); });
+    }
+  }
+
+  // Every size streams from the start of the buffer; the smaller ones
+  // are streamed over and over, at least _minBytes per run, so they are
+  // timed from the cache.  Warm up, then take the median of several runs.
+  template <class F> void Rates(const char *label, F stream)
+  {
+    static const int _warmup = 1;
+    static const int _runs = 5;
+    static const double _minBytes = 64 << 20;
+    size_t granule = 8*_vars*_unroll;
+    uint64_t state[_maxVars] = {};
+    fprintf(_fp, "// stream %s:", label);
+    for (size_t i=0; i<_streamSizes.size(); ++i)
+    {
+      // at least one trip through the loop
+      size_t blocks = std::max(_streamSizes[i] / granule, (size_t) 1) * _unroll;
+      double bytes = 8.0*_vars*blocks;
+      int reps = (int) std::max(1.0, _minBytes / bytes);
+      double runs[_runs];
+      for (int iRun=-_warmup; iRun<_runs; ++iRun)
+      {
+	std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+	for (int iRep=0; iRep<reps; ++iRep)
+	  stream(state, blocks);
+	std::chrono::duration<double> t = std::chrono::steady_clock::now() - t0;
+	if (iRun >= 0)
+	  runs[iRun] = bytes * reps / t.count() / 1e9;
+      }
+      std::sort(runs, runs + _runs);
+      fprintf(_fp, "%s %s %.2f", i ? "," : "", SizeName(_streamSizes[i]).c_str(), runs[_runs/2]);
+    }
+    fprintf(_fp, " GB/s\n");
+  }
+
+  // e.g. 4K, 256M, 3G
+  static std::string SizeName(size_t bytes)
+  {
+    static const char units[] = "KMGT";
+    char buf[32];
+    int i = -1;
+    while (i < 3 && bytes % 1024 == 0 && bytes >= 1024)
+    {
+      bytes /= 1024;
+      ++i;
+    }
+    if (i < 0)
+      snprintf(buf, sizeof buf, "%zu", bytes);
+    else
+      snprintf(buf, sizeof buf, "%zu%c", bytes, units[i]);
+    return buf;
+  }
+
+  static std::vector<uint64_t> SpeedData(size_t n)
+  {
+    std::vector<uint64_t> data(n);
+    for (size_t i=0; i<n; ++i)
+      data[i] = i * 0x9e3779b97f4a7c15ULL;
+    return data;
+  }
+
+  // of the last candidate to pass, see Speed()
+  double CyclesPerBlock() const
+  {
+    return _cyclesPerBlock;
+  }
+  int MinVal() const
+  {
+    return _minVal;
+  }
+
+  // How close the last candidate came to passing, for the guided
+  // search: the further it got through the cascade the better, then
+  // the closer its count of affected bits got to the limit, or the
+  // higher its minVal if it passed.
+  int Fitness() const
+  {
+    static const int _scale = 256;   // above any count that fails
+    if (_rejected < 0)
+      return _scale * (_cascade.size() + 1) + _minVal;
+    return _scale * _rejected + _failCounter;
+  }
+
+  // By name: spooky, alpha or akron.
+  bool Preload(const std::string& name)
+  {
+    if (name == "spooky")
+      PreloadSpooky();
+    else if (name == "alpha")
+      PreloadAlpha();
+    else if (name == "akron")
+      PreloadAkron();
+    else
+      return false;
+    return true;
+  }
+
+  // A small random change, for the guided search: mostly to one of
+  // the rotation constants, sometimes to the kind of a binop or to
+  // the var it takes.  The ops keep at least one ADD/SUB and one XOR.
+  void Mutate()
+  {
+    int what = _r.Value() % 8;
+    if (what == 6)
+    {
+      int iOp = _r.Value() % _ops;
+      if (_op[iOp] != OP_ROT)
+      {
+	int old = _op[iOp];
+	_op[iOp] = (old + 1 + _r.Value() % 2) % MOD_BINOP;
+	int nxor = std::count(_op, _op + _ops, (int) OP_XOR);
+	int nrot = std::count(_op, _op + _ops, (int) OP_ROT);
+	if (nxor > 0 && nxor + nrot < _ops)
+	  return;
+	_op[iOp] = old;
+      }
+    }
+    else if (what == 7)
+    {
+      int iOp = 1 + _r.Value() % (_ops - 1);
+      if (_op[iOp] != OP_ROT)
+      {
+	int v2 = _r.Value() % (_vars - 1);
+	_v2[iOp] = v2 + (v2 >= _v1[iOp]);
+	return;
+      }
+    }
+    else if (what == 5)
+    {
+      int i = _r.Value() % _vars, j = _r.Value() % _vars;
+      std::swap(_s[i], _s[j]);
+      _s[i + _vars] = _s[i];
+      _s[j + _vars] = _s[j];
+      return;
+    }
+    int iVar = _r.Value() % _vars;
+    _s[iVar] = _s[iVar + _vars] = (_r.Value() % 65);
+  }
+
+  // whether the last candidate was dropped for falling behind the front
+  bool Dominated() const
+  {
+    return _dominated;
+  }
+
+  // A single pass over every start, without the robust estimate.
+  int Screen(MixSet& Mix, const Stage& stage)
+  {
+    for (int iVar=0; iVar<_vars; ++iVar)
+    {
+      if (OneTest(Mix(1, iVar), stage.step) == 0) return 0;
+      if (stage.forward)
+	continue;
+      if (OneTest(Mix(0, iVar), stage.step) == 0) return 0;
+    }
+    return 1;
+  }
+
+  // Which stage rejected the last candidate: an index into the cascade,
+  // the cascade size for the full Test(), or -1 if it passed.
+  int Rejected() const
+  {
+    return _rejected;
+  }
+
+  // The output is a C program that benchmarks the functions that pass,
+  // and the ones we started from, see Post().
+  void Pre()
+  {
+    fprintf(_fp, "#include <stdio.h>\n");
+    fprintf(_fp, "#include <stdint.h>\n");
+    fprintf(_fp, "#include <stdlib.h>\n");
+    fprintf(_fp, "#include <string.h>\n");
+    fprintf(_fp, "#include <time.h>\n");
+    fprintf(_fp, "#if (defined(__x86_64__) || defined(__i386__)) && !defined(USE_CLOCK_GETTIME)\n");
+    fprintf(_fp, "#include <x86intrin.h>\n");
+    fprintf(_fp, "#endif\n");
+    fprintf(_fp, "\n");
+    fprintf(_fp, "#define VAR %d\n", _vars);
+    fprintf(_fp, "#define Rot64(x,k) (((x)<<(k)) | ((x)>>(64-(k))))\n");
+    fprintf(_fp, "#define Bswap64(x) __builtin_bswap64(x)\n");
+    fprintf(_fp, "\n");
+    fprintf(_fp, "// The TSC where there is one, else the monotonic clock in nanoseconds.\n");
+    fprintf(_fp, "#if (defined(__x86_64__) || defined(__i386__)) && !defined(USE_CLOCK_GETTIME)\n");
+    fprintf(_fp, "#define UNIT \"TSC ticks/byte\"\n");
+    fprintf(_fp, "static inline uint64_t Now(void)\n");
+    fprintf(_fp, "{\n");
+    fprintf(_fp, "  _mm_lfence();\n");
+    fprintf(_fp, "  uint64_t t = __rdtsc();\n");
+    fprintf(_fp, "  _mm_lfence();\n");
+    fprintf(_fp, "  return t;\n");
+    fprintf(_fp, "}\n");
+    fprintf(_fp, "#else\n");
+    fprintf(_fp, "#define UNIT \"ns/byte\"\n");
+    fprintf(_fp, "static inline uint64_t Now(void)\n");
+    fprintf(_fp, "{\n");
+    fprintf(_fp, "  struct timespec ts;\n");
+    fprintf(_fp, "  clock_gettime(CLOCK_MONOTONIC, &ts);\n");
+    fprintf(_fp, "  return ts.tv_sec * 1000000000ull + ts.tv_nsec;\n");
+    fprintf(_fp, "}\n");
+    fprintf(_fp, "#endif\n");
+    fprintf(_fp, "\n");
+    fprintf(_fp, "// Each function is benchmarked as it would be used, streaming\n");
+    fprintf(_fp, "// consecutive blocks of data into the state.\n");
+    fprintf(_fp, "typedef void (*stream_t)(const uint64_t *data, size_t blocks, uint64_t *state);\n");
+    fprintf(_fp, "\n");
+  }
+
+  // print the function in C++ code
+  void ReportCode(int version)
+  {
+    char name[16];
+    snprintf(name, sizeof name, "%d", version);
+    Throughput((std::string("function") + name).c_str());
+    ReportFunctions(name, "function", "stream");
+  }
+
+  // As functionN(), which mixes one block of data into the state,
+  // and streamN(), which mixes consecutive blocks, keeping the state
+  // in the variables.
+  void ReportFunctions(const char *name, const char *function, const char *stream)
+  {
+    fprintf(_fp, "static const char structure%s[] = \"", name);
+    ReportStructure();
+    fprintf(_fp, "\";\n");
+    fprintf(_fp, "\n");
+    fprintf(_fp, "void %s%s(uint64_t *data, uint64_t *state)\n", function, name);
+    fprintf(_fp, "{\n");
+    
+    for (int iVar=0; iVar<_vars; ++iVar)
+    {
+      fprintf(_fp, "    uint64_t s%d = state[%d];\n", iVar, iVar);
+    }
+
+    ReportBody();
+    
+    for (int iVar=0; iVar<_vars; ++iVar)
+    {
+      fprintf(_fp, "    state[%d] = s%d;\n", iVar, iVar);
+    }
+
+    fprintf(_fp, "}\n");
+    fprintf(_fp, "\n");
+    fprintf(_fp, "static void %s%s(const uint64_t *data, size_t blocks, uint64_t *state)\n", stream, name);
+    fprintf(_fp, "{\n");
+    for (int iVar=0; iVar<_vars; ++iVar)
+    {
+      fprintf(_fp, "    uint64_t s%d = state[%d];\n", iVar, iVar);
+    }
+    fprintf(_fp, "    for (size_t i=0; i<blocks; ++i, data += VAR) {\n");
+    ReportBody();
+    fprintf(_fp, "    }\n");
+    for (int iVar=0; iVar<_vars; ++iVar)
+    {
+      fprintf(_fp, "    state[%d] = s%d;\n", iVar, iVar);
+    }
+    fprintf(_fp, "}\n");
+    fprintf(_fp, "\n");
+  }
+
+  // the rounds of mixing one block of data[] into s0..s{VAR-1}
+  void ReportBody()
+  {
+    for (int iIter=0; iIter<_iters; ++iIter)
+    {
+      for (int iVar=0; iVar<_vars; ++iVar)
+      {
+	const char opc[] = "+-^????";
+	fprintf(_fp, "    s%d %c= data[%d];", iVar, opc[_op[0]], iVar);
+	for (int iOp=1; iOp<_ops; ++iOp)
+	{
+	  PrintOp(_fp, _op[iOp], 
+		  (_v1[iOp] + iVar) % _vars, 
+		  (_v2[iOp] + iVar) % _vars, 
+		  _s[iVar]);
+	}
+	fprintf(_fp, "\n");
+      }
+    }
+  }
+
+  void ReportStructure()
+  {
+    for (int iOp=0; iOp<_ops; ++iOp)
+    {
+      fprintf(_fp, "%1d %2d %2d ", _op[iOp], _v1[iOp], _v2[iOp]);
+    }
+    fprintf(_fp, " ");
+    for (int iVar=0; iVar<_vars; ++iVar)
+    {
+      fprintf(_fp, "%2d ", _s[iVar]);
+    }
+  }
+
+  // The baselines, which are for 12 vars, then the table of the
+  // functions, and main(), which times them on buffers from L1
+  // through DRAM (or of the sizes given).
+  void Post(int numFunctions)
+  {
+    static const char *baselines[] = { "spooky", "alpha", "akron" };
+    int nBaselines = (_vars == 12) ? 3 : 0;
+    Structure st;
+    Save(st);
+    for (int i=0; i<nBaselines; ++i)
+    {
+      Preload(baselines[i]);
+      ReportFunctions(baselines[i], "function_", "stream_");
+    }
+    Load(st);
+
+    fprintf(_fp, "static const struct {\n");
+    fprintf(_fp, "  const char *name;\n");
+    fprintf(_fp, "  stream_t stream;\n");
+    fprintf(_fp, "  const char *structure;\n");
+    fprintf(_fp, "} mixes[] = {\n");
+    for (int i=0; i<nBaselines; ++i)
+    {
+      fprintf(_fp, "  { \"%s\", stream_%s, structure%s },\n", baselines[i], baselines[i], baselines[i]);
+    }
+    for (int i=0; i<numFunctions; ++i)
+    {
+      fprintf(_fp, "  { \"function%d\", stream%d, structure%d },\n", i, i, i);
+    }
+    fprintf(_fp, "  { NULL, NULL, NULL },\n");
+    fprintf(_fp, "};\n");
+    fprintf(_fp, "\n");
+    fprintf(_fp, "#define WARMUP 2\n");
+    fprintf(_fp, "#define RUNS 9\n");
+    fprintf(_fp, "#define MIN_BYTES (64 << 20)   // per run, so that the small buffers time well\n");
+    fprintf(_fp, "\n");
+    fprintf(_fp, "static uint64_t sink;\n");
+    fprintf(_fp, "\n");
+    fprintf(_fp, "static int cmp(const void *a, const void *b)\n");
+    fprintf(_fp, "{\n");
+    fprintf(_fp, "  double x = *(const double *) a, y = *(const double *) b;\n");
+    fprintf(_fp, "  return (x > y) - (x < y);\n");
+    fprintf(_fp, "}\n");
+    fprintf(_fp, "\n");
+    fprintf(_fp, "// The median of the runs over the buffer, after the warmup, per byte.\n");
+    fprintf(_fp, "static double Measure(stream_t stream, const uint64_t *data, size_t bytes)\n");
+    fprintf(_fp, "{\n");
+    fprintf(_fp, "  size_t blocks = bytes / (8*VAR);\n");
+    fprintf(_fp, "  size_t passes = MIN_BYTES / bytes + 1;\n");
+    fprintf(_fp, "  uint64_t state[VAR] = {0};\n");
+    fprintf(_fp, "  double runs[RUNS];\n");
+    fprintf(_fp, "  for (int iRun = -WARMUP; iRun < RUNS; iRun++) {\n");
+    fprintf(_fp, "    uint64_t a = Now();\n");
+    fprintf(_fp, "    for (size_t i = 0; i < passes; i++)\n");
+    fprintf(_fp, "      stream(data, blocks, state);\n");
+    fprintf(_fp, "    uint64_t z = Now();\n");
+    fprintf(_fp, "    if (iRun >= 0)\n");
+    fprintf(_fp, "      runs[iRun] = (double) (z - a) / (passes * blocks * 8*VAR);\n");
+    fprintf(_fp, "  }\n");
+    fprintf(_fp, "  for (int i = 0; i < VAR; i++)\n");
+    fprintf(_fp, "    sink ^= state[i];\n");
+    fprintf(_fp, "  qsort(runs, RUNS, sizeof runs[0], cmp);\n");
+    fprintf(_fp, "  return runs[RUNS/2];\n");
+    fprintf(_fp, "}\n");
+    fprintf(_fp, "\n");
+    fprintf(_fp, "// Sizes are in KiB, from L1 through DRAM unless given.\n");
+    fprintf(_fp, "int main(int argc, char **argv)\n");
+    fprintf(_fp, "{\n");
+    fprintf(_fp, "  size_t sizes[32] = { 16, 256, 8 << 10, 128 << 10 };\n");
+    fprintf(_fp, "  int nsizes = 4;\n");
+    fprintf(_fp, "  if (argc > 1) {\n");
+    fprintf(_fp, "    nsizes = 0;\n");
+    fprintf(_fp, "    for (int i = 1; i < argc && nsizes < 32; i++) {\n");
+    fprintf(_fp, "      sizes[nsizes] = strtoul(argv[i], NULL, 0);\n");
+    fprintf(_fp, "      if (sizes[nsizes] == 0) {\n");
+    fprintf(_fp, "\tfprintf(stderr, \"Usage: %%s [KIB...]\\n\", argv[0]);\n");
+    fprintf(_fp, "\treturn 2;\n");
+    fprintf(_fp, "      }\n");
+    fprintf(_fp, "      nsizes++;\n");
+    fprintf(_fp, "    }\n");
+    fprintf(_fp, "  }\n");
+    fprintf(_fp, "  size_t max = 0, kib[32];\n");
+    fprintf(_fp, "  for (int i = 0; i < nsizes; i++) {\n");
+    fprintf(_fp, "    kib[i] = sizes[i];\n");
+    fprintf(_fp, "    sizes[i] = sizes[i] * 1024 / (8*VAR) * (8*VAR);\n");
+    fprintf(_fp, "    if (sizes[i] == 0)\n");
+    fprintf(_fp, "      sizes[i] = 8*VAR;\n");
+    fprintf(_fp, "    if (sizes[i] > max)\n");
+    fprintf(_fp, "      max = sizes[i];\n");
+    fprintf(_fp, "  }\n");
+    fprintf(_fp, "  uint64_t *data = aligned_alloc(64, (max + 63) / 64 * 64);\n");
+    fprintf(_fp, "  if (data == NULL) {\n");
+    fprintf(_fp, "    perror(\"aligned_alloc\");\n");
+    fprintf(_fp, "    return 1;\n");
+    fprintf(_fp, "  }\n");
+    fprintf(_fp, "  uint64_t x = 0x9e3779b97f4a7c15ull;\n");
+    fprintf(_fp, "  for (size_t i = 0; i < max / 8; i++) {\n");
+    fprintf(_fp, "    x ^= x << 13, x ^= x >> 7, x ^= x << 17;\n");
+    fprintf(_fp, "    data[i] = x;\n");
+    fprintf(_fp, "  }\n");
+    fprintf(_fp, "\n");
+    fprintf(_fp, "  printf(\"%%-12s\", UNIT);\n");
+    fprintf(_fp, "  for (int i = 0; i < nsizes; i++) {\n");
+    fprintf(_fp, "    char label[32];\n");
+    fprintf(_fp, "    if (kib[i] >= 1024 && kib[i] %% 1024 == 0)\n");
+    fprintf(_fp, "      snprintf(label, sizeof label, \"%%zuM\", kib[i] >> 10);\n");
+    fprintf(_fp, "    else\n");
+    fprintf(_fp, "      snprintf(label, sizeof label, \"%%zuK\", kib[i]);\n");
+    fprintf(_fp, "    printf(\" %%9s\", label);\n");
+    fprintf(_fp, "  }\n");
+    fprintf(_fp, "  printf(\"   vs %%s\\n\", mixes[0].name);\n");
+    fprintf(_fp, "  if (mixes[0].name == NULL)\n");
+    fprintf(_fp, "    return 0;\n");
+    fprintf(_fp, "  double base[32];\n");
+    fprintf(_fp, "  for (int m = 0; mixes[m].name; m++) {\n");
+    fprintf(_fp, "    printf(\"%%-12s\", mixes[m].name);\n");
+    fprintf(_fp, "    // the mean of the ratios to the first, over the sizes\n");
+    fprintf(_fp, "    double ratio = 0;\n");
+    fprintf(_fp, "    for (int i = 0; i < nsizes; i++) {\n");
+    fprintf(_fp, "      double t = Measure(mixes[m].stream, data, sizes[i]);\n");
+    fprintf(_fp, "      if (m == 0)\n");
+    fprintf(_fp, "\tbase[i] = t;\n");
+    fprintf(_fp, "      ratio += t / base[i];\n");
+    fprintf(_fp, "      printf(\" %%9.3f\", t);\n");
+    fprintf(_fp, "      fflush(stdout);\n");
+    fprintf(_fp, "    }\n");
+    fprintf(_fp, "    printf(\"   %%.2fx  %%s\\n\", ratio / nsizes, mixes[m].structure);\n");
+    fprintf(_fp, "  }\n");
+    fprintf(_fp, "  free(data);\n");
+    fprintf(_fp, "  return sink == 42;\n");
+    fprintf(_fp, "}\n");
+  }
+
+
+private:
+
+  void ConnectBinops(int rotpos)
+  {
+    int iOp = 1;
+    iOp += (iOp == rotpos);
+    SetBinopVars(iOp++, 2, _vars - 2); // s2 ?= s10
+    iOp += (iOp == rotpos);
+    SetBinopVars(iOp++, _vars - 1, 0); // s11 ?= s0
+    iOp += (iOp == rotpos);
+    SetBinopVars(iOp++, _vars - 1, 1); // s11 ?= s1
+  }
+
+  // whether ops a and b, each an (op, v1, v2) triple, can be swapped
+  static bool Commute(const int *a, const int *b)
+  {
+    bool aRot = (a[0] == OP_ROT), bRot = (b[0] == OP_ROT);
+    // what each op reads besides the var it writes
+    bool aReads = !aRot, bReads = !bRot;
+    if (a[1] != b[1])
+      return !(aReads && a[2] == b[1]) && !(bReads && b[2] == a[1]);
+    if (aRot || bRot || a[2] == a[1] || b[2] == b[1])
+      return false;
+    return (a[0] == OP_XOR) == (b[0] == OP_XOR);
+  }
+
+  // print operation
+  static void inline PrintOp(FILE *fp, int k, int x, int y, int s)
+  {
+    switch (k) {
+    case OP_ADD: fprintf(fp, "    s%d += s%d;", x, y); break;
+    case OP_SUB: fprintf(fp, "    s%d -= s%d;", x, y); break;
+    case OP_XOR: fprintf(fp, "    s%d ^= s%d;", x, y); break;
+    default: assert(k == OP_ROT);
+      if (s == 0 || s == 64)
+	fprintf(fp, "    s%d = Bswap64(s%d);", x, x);
+      else
+	fprintf(fp, "    s%d = Rot64(s%d, %d);", x, x, s);
+    }
+  }
+
+
+  // The (iBit, iBit2) pairs that OneTest() goes through with this step,
+  // as iBit << 16 | iBit2.  iBit covers just key[0], because that is the
+  // variable we start at, and iBit2 goes through iBit, iBit+step, ...
+  // The cells of 64 iBit2 each go in the order of SetOrder(), or else
+  // iBit by iBit.
+  const std::vector<uint32_t>& Pairs(int step)
+  {
+    std::vector<uint32_t>& pairs = _pairs[step];
+    if (!pairs.empty())
+      return pairs;
+    for (int i=0; i<64*_vars; ++i)
+    {
+      int cell = _order ? (*_order)[i] : i;
+      int iBit = cell / _vars, lo = cell % _vars * 64;
+      for (int iBit2=std::max(lo, iBit); iBit2<lo+64; ++iBit2)
+      {
+	if (step ? (iBit2 - iBit) % step == 0 : iBit2 == iBit)
+	  pairs.push_back(iBit << 16 | iBit2);
+      }
+    }
+    return pairs;
+  }
+
+  // The inputs of each pair come from its own stream, so that
+  // the verdict does not depend on the order of the pairs.
+  static inline uint64_t SplitMix(uint64_t& k)
+  {
+    uint64_t z = (k += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+  }
+
+  // Flip each bit of the data block in turn, for each of the trials
+  // (random state and data), and count how often that flips each bit
+  // of the state after the Mix: the full avalanche matrix.
+  Bias::Result BiasTest(JitMixFunc& Mix)
+  {
+    Stats::Timer timer(_stats, Stats::BIAS);
+    const int bits = 64*_vars;
+    const int n = 1 + bits;  // as is, then with each bit flipped
+    const int lanes = Mix.Lanes();
+    int granule = Mix.Granule();
+    std::vector<uint64_t> state((n + granule - 1) / granule * granule * _vars);
+    std::vector<uint64_t> data(state.size());
+    Bias bias(bits, bits, _biasAdd);
+    for (int iTrial=0; iTrial<_biasTrials; ++iTrial)
+    {
+      for (int iVar=0; iVar<_vars; ++iVar)
+      {
+	uint64_t s = _r.Value(), d = _r.Value();
+	for (int i=0; i<n; ++i)
+	{
+	  Mix.Block(&state[0], i)[iVar*lanes] = s;
+	  Mix.Block(&data[0], i)[iVar*lanes] = d;
+	}
+      }
+      for (int iBit=0; iBit<bits; ++iBit)
+	Mix.Block(&data[0], 1 + iBit)[iBit/64*lanes] ^= ((uint64_t)1) << (iBit & 63);
+      Mix.Batch(&state[0], &data[0], n);
+      const uint64_t *a0 = Mix.Block(&state[0], 0);
+      for (int iBit=0; iBit<bits; ++iBit)
+      {
+	const uint64_t *a1 = Mix.Block(&state[0], 1 + iBit);
+	uint64_t diff[_maxVars];
+	for (int iVar=0; iVar<_vars; ++iVar)
+	  diff[iVar] = a0[iVar*lanes] ^ a1[iVar*lanes];
+	bias.Add(iBit, diff);
+      }
+      bias.EndTrial();
+    }
+    return bias.Get();
+  }
+
+  // Step through iBit2 values, 1 for the full sweep, or 0 to try
+  // single-bit flips only.
+  int OneTest(JitMixFunc& Mix, int step = 1)
+  {
+    static const int _measures = Counter::_measures;  // number of different ways of looking
+    static const int _trials = 3;     // number of pairs of hashes
+    static const int _limit =3*64;    // minimum number of bits affected
+    static const int _batch = 32;     // bit pairs per call into the JIT
+    int minVal = _vars*64;
+
+    // Inputs and outputs of the whole batch, both of each pair
+    // of hashes, for each trial, for each (iBit, iBit2) pair,
+    // laid out as Mix.Block() says.
+    static const int _evals = 2*_trials*_batch;
+    uint64_t state[_evals*_maxVars];
+    uint64_t data[_evals*_maxVars];
+    const int lanes = Mix.Lanes();
+    assert(_evals % Mix.Granule() == 0);
+
+    uint64_t base = _r.Value();
+    const std::vector<uint32_t>& pairs = Pairs(step);
+    for (size_t iPair0=0; iPair0<pairs.size(); iPair0 += _batch)
+    {
+      int nPairs = std::min((size_t) _batch, pairs.size() - iPair0);
+      uint64_t t = Stats::Now();
+      for (int iPair=0; iPair<nPairs; ++iPair)
+      {
+	uint32_t pair = pairs[iPair0 + iPair];
+	int iBit = pair >> 16, iBit2 = pair & 0xffff;
+	uint64_t k = base ^ (pair * 0xff51afd7ed558ccdULL);
+	for (int iTrial=0; iTrial<_trials; ++iTrial)
+	{
+	  // test one pair of inputs
+	  int iEval = 2*(iPair*_trials + iTrial);
+	  uint64_t *a0 = Mix.Block(state, iEval);
+	  uint64_t *a1 = Mix.Block(state, iEval + 1);
+	  uint64_t *d0 = Mix.Block(data, iEval);
+	  uint64_t *d1 = Mix.Block(data, iEval + 1);
+	  for (int iVar=0; iVar<_vars; ++iVar)
+	  {
+	    uint64_t value = SplitMix(k);
+	    a0[iVar*lanes] = value;  // input/output of first of pair
+	    a1[iVar*lanes] = value;  // input/output of second of pair
+	    d0[iVar*lanes] = d1[iVar*lanes] = 0;
+	  }
+
+	  // second of pair, differing in one bit
+	  d1[iBit/64*lanes] ^= (((uint64_t)1) << (iBit & 63));
+	  if (iBit2 != iBit)
+	  {
+	    d1[iBit2/64*lanes] ^= (((uint64_t)1) << (iBit2 & 63));
+	  }
+	}
+      }
+      Mix.Pad(state, data, 2*_trials*nPairs);
+      t = _stats.Lap(Stats::SETUP, t);
+
+      // evaluate both of each pair
+      Mix.Batch(state, data, 2*_trials*nPairs);
+      t = _stats.Lap(Stats::MIX, t);
+
+      for (int iPair=0; iPair<nPairs; ++iPair)
+      {
+	// both of each pair of hashes, for all the trials, [trial][var]
+	uint64_t x[_trials*_maxVars], y[_trials*_maxVars];
+	for (int iTrial=0; iTrial<_trials; ++iTrial)
+	{
+	  int iEval = 2*(iPair*_trials + iTrial);
+	  const uint64_t *a0 = Mix.Block(state, iEval);
+	  const uint64_t *a1 = Mix.Block(state, iEval + 1);
+	  for (int iVar=0; iVar<_vars; ++iVar)
+	  {
+	    x[iTrial*_vars + iVar] = a0[iVar*lanes];
+	    y[iTrial*_vars + iVar] = a1[iVar*lanes];
+	  }
+	}
+	int count[_measures];
+	_count(x, y, _trials, _vars, count);
+	for (int iMeasure=0; iMeasure<_measures; ++iMeasure)
+	{
+	  int counter = count[iMeasure];
+	  if (counter < _limit)
+	  {
+	    uint32_t pair = pairs[iPair0 + iPair];
+	    int iBit = pair >> 16, iBit2 = pair & 0xffff;
+	    if (1)
+	    {
+	      fprintf(_log, "// fail %d %d %d\n", iMeasure, iBit, counter);
+	    }
+	    _failCounter = counter;
+	    _failCell = iBit*_vars + iBit2/64;
+	    _stats.fail[iMeasure][iBit]++;
+	    _stats.Lap(Stats::COUNT, t);
+	    return 0;
+	  }
+	  if (counter < minVal)
+	  {
+	    minVal = counter;
+	  }
+	}
+      }
+      _stats.Lap(Stats::COUNT, t);
+    }
+    return minVal;
+  }
+
+  class JitMixFunc
+  {
+    struct jit *jit;
+    int vars;        // words of state
+    int lanes;       // 1 for the scalar code, else the vector width
+    int unroll;      // blocks per trip through the loop
+    // Runs the mix over n consecutive (state, data) blocks; with vectors,
+    // a block holds each var for all the lanes, i.e. [vars][lanes].
+    typedef void (*func_t)(uint64_t *state, const uint64_t *data, size_t n);
+    func_t func;
+
+    // One step of the mix, before registers are assigned:
+    // sX ?= sY, sX ?= data[Y], or sX = permute(sX, param)
+    struct Insn
+    {
+      OP_e op;
+      bool data;
+      int dst, src, param;
+      int shift;     // which of the shifts the rotation takes
+    };
+    std::vector<Insn> body;
+    bool forward;
+    int start;       // where the shifts begin in _s
+
+    // The rotations can be patched, see Retune(): [patch id, insn]
+    bool patchable;
+    std::vector<std::pair<int, int> > patches;
+
+    // Register assignment, when the vars do not fit.
+    int nregs;                 // registers available for the vars
+    std::vector<int> regOf;    // var -> register, or -1
+    std::vector<int> varIn;    // register -> var, or -1
+    std::vector<bool> dirty;   // the register differs from memory
+    std::vector<int> nextUse;  // the next insn that needs the var
+
+    // Scalar or vector instructions, depending on the number of lanes.
+    void ADD(int dst, int src) { if (lanes == 1) jins_ADD(jit, (JR_e) dst, (JR_e) src); else jins_VADD(jit, (JV_e) dst, (JV_e) src); }
+    void SUB(int dst, int src) { if (lanes == 1) jins_SUB(jit, (JR_e) dst, (JR_e) src); else jins_VSUB(jit, (JV_e) dst, (JV_e) src); }
+    void XOR(int dst, int src) { if (lanes == 1) jins_XOR(jit, (JR_e) dst, (JR_e) src); else jins_VXOR(jit, (JV_e) dst, (JV_e) src); }
+    void ROTL(int reg, int s) { if (lanes == 1) jins_ROTL(jit, (JR_e) reg, s); else jins_VROTL(jit, (JV_e) reg, s); }
+    void BSWAP(int reg) { if (lanes == 1) jins_BSWAP(jit, (JR_e) reg); else jins_VBSWAP(jit, (JV_e) reg); }
+    void ADDrm(int dst, JINS_MEM_ARG) { if (lanes == 1) jins_ADDrm(jit, (JR_e) dst, mem, disp); else jins_VADDrm(jit, (JV_e) dst, mem, disp); }
+    void SUBrm(int dst, JINS_MEM_ARG) { if (lanes == 1) jins_SUBrm(jit, (JR_e) dst, mem, disp); else jins_VSUBrm(jit, (JV_e) dst, mem, disp); }
+    void XORrm(int dst, JINS_MEM_ARG) { if (lanes == 1) jins_XORrm(jit, (JR_e) dst, mem, disp); else jins_VXORrm(jit, (JV_e) dst, mem, disp); }
+    void MOVrm(int dst, JINS_MEM_ARG) { if (lanes == 1) jins_MOVrm(jit, (JR_e) dst, mem, disp); else jins_VMOVrm(jit, (JV_e) dst, mem, disp); }
+    void MOVmr(JINS_MEM_ARG, int src) { if (lanes == 1) jins_MOVmr(jit, mem, disp, (JR_e) src); else jins_VMOVmr(jit, mem, disp, (JV_e) src); }
+
+    // where the var sits in a block
+    int Disp(int iVar)
+    {
+      return 8*lanes*iVar;
+    }
+
+    // Put the state variables into registers.
+    void Unpack()
+    {
+      for (int iVar=0; iVar <vars; ++iVar)
+	MOVrm(iVar, JINS_MEM(JR_ARG0, Disp(iVar)));
+    }
+
+    // Gather the state back.
+    void Bundle()
+    {
+      for (int iVar=0; iVar <vars; ++iVar)
+	MOVmr(JINS_MEM(JR_ARG0, Disp(iVar)), iVar);
+    }
+
+    void Record(OP_e op, bool data, int dst, int src, int param, int shift = 0)
+    {
+      Insn insn = { op, data, dst, src, param, shift };
+      body.push_back(insn);
+    }
+
+    // Trickle-feed some data into the state: sX ?= data[X]
+    void Feed(OP_e op, int iVar)
+    {
+      assert(op != OP_ROT);
+      Record(op, true, iVar, iVar, 0);
+    }
+
+    // In the reverse direction, not symmetric (see below)
+    void RFeed(OP_e op, int iState, int iData)
+    {
+      static const OP_e rev[] = { OP_SUB, OP_ADD, OP_XOR };
+      assert(op != OP_ROT);
+      Record(rev[op], true, iState, iData, 0);
+    }
+
+    // The rotation by the shift constant, either way.
+    static int Param(bool forward, int s)
+    {
+      return forward ? s % 64 : (64 - s % 64) % 64;
+    }
+
+    // A mixing step: sX ?= sY, or possibly sX = permute(sX, shifts[iShift])
+    void Op(OP_e op, int dst, int src, const int *shifts, int iShift)
+    {
+      if (op == OP_ROT)
+	Record(op, false, dst, dst, Param(true, shifts[iShift]), iShift);
+      else
+	Record(op, false, dst, src, 0);
+    }
+
+    void ROp(OP_e op, int dst, int src, const int *shifts, int iShift)
+    {
+      static const OP_e rev[] = { OP_SUB, OP_ADD, OP_XOR };
+      if (op == OP_ROT)
+	Record(op, false, dst, dst, Param(false, shifts[iShift]), iShift);
+      else
+	Record(rev[op], false, dst, src, 0);
+    }
+
+    // Emit a step on registers; without the src register,
+    // the operand comes from memory.
+    void Emit(const Insn& insn, int dst, int src, JINS_MEM_ARG)
+    {
+      if (insn.op == OP_ROT && patchable)
+      {
+	int id = (lanes == 1) ? jins_ROTLp(jit, (JR_e) dst, insn.param) :
+	  jins_VROTLp(jit, (JV_e) dst, insn.param);
+	patches.push_back(std::make_pair(id, (int) (&insn - &body[0])));
+	return;
+      }
+      if (insn.op == OP_ROT)
+      {
+	if (insn.param == 0)
+	  BSWAP(dst);
+	else
+	  ROTL(dst, insn.param);
+	return;
+      }
+      if (src >= 0)
+      {
+	switch (insn.op) {
+	case OP_ADD: ADD(dst, src); break;
+	case OP_SUB: SUB(dst, src); break;
+	default: XOR(dst, src); break;
+	}
+	return;
+      }
+      switch (insn.op) {
+      case OP_ADD: ADDrm(dst, mem, disp); break;
+      case OP_SUB: SUBrm(dst, mem, disp); break;
+      default: XORrm(dst, mem, disp); break;
+      }
+    }
+
+    // Every var in its own register, for the whole block, or
+    // across the blocks if not packed.
+    void EmitDirect(bool pack)
+    {
+      if (pack)
+	Unpack();
+      for (size_t i=0; i<body.size(); ++i)
+      {
+	const Insn& insn = body[i];
+	if (insn.data)
+	  Emit(insn, insn.dst, -1, JINS_MEM(JR_ARG1, Disp(insn.src)));
+	else
+	  Emit(insn, insn.dst, insn.src, JINS_MEM0(JR_ARG0));
+      }
+      if (pack)
+	Bundle();
+    }
+
+    // Write the var back to the state if needed, and free the register.
+    void Evict(int reg)
+    {
+      int iVar = varIn[reg];
+      if (dirty[iVar])
+	MOVmr(JINS_MEM(JR_ARG0, Disp(iVar)), reg);
+      dirty[iVar] = false;
+      regOf[iVar] = -1;
+      varIn[reg] = -1;
+    }
+
+    // Load the var into a free register, or else into the one whose var
+    // is needed furthest in the future (Belady), other than keep.  Without
+    // load, the caller loads it.
+    int Assign(int iVar, int keep, bool load = true)
+    {
+      int best = -1;
+      for (int reg=0; reg<nregs; ++reg)
+      {
+	if (varIn[reg] < 0)
+	{
+	  best = reg;
+	  break;
+	}
+	if (varIn[reg] == keep)
+	  continue;
+	if (best < 0 || nextUse[varIn[reg]] > nextUse[varIn[best]])
+	  best = reg;
+      }
+      if (varIn[best] >= 0)
+	Evict(best);
+      if (load)
+	MOVrm(best, JINS_MEM(JR_ARG0, Disp(iVar)));
+      varIn[best] = iVar;
+      regOf[iVar] = best;
+      return best;
+    }
+
+    // More vars than registers: the state block in memory is the home of
+    // the vars, and the registers cache them.  The destination of a step
+    // must be in a register; a source that is not is taken from memory,
+    // unless it is needed again in the block and there is a free register
+    // to keep it in.  The registers are written back at the end of the
+    // block if flush, else they carry over into the next block, which
+    // must mix into the same state.
+    void EmitSpilled(bool flush)
+    {
+      int n = body.size();
+      std::vector<int> nextDst(n), nextSrc(n);
+      nextUse.assign(vars, INT_MAX);
+      for (int i=n; i--;)
+      {
+	const Insn& insn = body[i];
+	int nd = nextUse[insn.dst];
+	int ns = insn.data ? 0 : nextUse[insn.src];
+	nextDst[i] = nd;
+	nextUse[insn.dst] = i;
+	if (!insn.data)
+	{
+	  nextSrc[i] = ns;
+	  nextUse[insn.src] = i;
+	}
+      }
+
+      for (int i=0; i<n; ++i)
+      {
+	const Insn& insn = body[i];
+	int src = (insn.data || insn.op == OP_ROT) ? -1 : insn.src;
+	// a scalar rotation loads the var itself, with RORX or MOVBE
+	// where the CPU has them
+	bool fuse = regOf[insn.dst] < 0 && insn.op == OP_ROT && lanes == 1 && !patchable;
+	if (regOf[insn.dst] < 0)
+	  Assign(insn.dst, src, !fuse);
+	if (src >= 0 && regOf[src] < 0 && nextSrc[i] != INT_MAX &&
+	    std::find(varIn.begin(), varIn.end(), -1) != varIn.end())
+	  Assign(src, insn.dst);
+	int dst = regOf[insn.dst];
+	if (fuse && insn.param == 0)
+	  jins_BSWAPrm(jit, (JR_e) dst, JINS_MEM(JR_ARG0, Disp(insn.dst)));
+	else if (fuse)
+	  jins_ROTLrm(jit, (JR_e) dst, JINS_MEM(JR_ARG0, Disp(insn.dst)), insn.param);
+	else if (insn.data)
+	  Emit(insn, dst, -1, JINS_MEM(JR_ARG1, Disp(insn.src)));
+	else
+	  Emit(insn, dst, src >= 0 ? regOf[src] : -1, JINS_MEM(JR_ARG0, Disp(insn.src)));
+	dirty[insn.dst] = true;
+	nextUse[insn.dst] = nextDst[i];
+	if (!insn.data)
+	  nextUse[insn.src] = nextSrc[i];
+      }
+      for (int reg=0; flush && reg<nregs; ++reg)
+	if (varIn[reg] >= 0)
+	  Evict(reg);
+    }
+
+    // How long until the result of a step is ready.
+    static int Latency(const Insn& insn, const Uarch& u)
+    {
+      if (insn.op != OP_ROT)
+	return 1;
+      return insn.param == 0 ? u.latBswap : u.latRot;
+    }
+
+    // List-schedule the steps of a block.  The source order does one
+    // var after another, a dependent chain at a time, and leaves it to
+    // the out-of-order window to find the parallelism across the vars.
+    // Instead, each step goes into the first cycle its operands are
+    // ready, at most u.width of them and u.rotPorts rotations a cycle,
+    // those on the longest path to the end of the block first.  Every
+    // var must be in its own register, or the order would cost spills.
+    void Schedule(const Uarch& u)
+    {
+      int n = body.size();
+
+      // Each step follows the last to write the vars it reads, once the
+      // result is ready, and, as it writes its dst, the steps that read
+      // the old value, in the same cycle at the earliest: [step, latency]
+      std::vector<std::vector<std::pair<int, int> > > succ(n);
+      std::vector<int> npred(n, 0);
+      std::vector<int> lastWrite(vars, -1);
+      std::vector<std::vector<int> > readers(vars);
+      for (int i=0; i<n; ++i)
+      {
+	const Insn& insn = body[i];
+	int reads[2] = { insn.dst, (insn.data || insn.op == OP_ROT) ? -1 : insn.src };
+	for (int k=0; k<2; ++k)
+	{
+	  int iVar = reads[k];
+	  if (iVar < 0)
+	    continue;
+	  int w = lastWrite[iVar];
+	  if (w >= 0)
+	  {
+	    succ[w].push_back(std::make_pair(i, Latency(body[w], u)));
+	    npred[i]++;
+	  }
+	  readers[iVar].push_back(i);
+	}
+	for (size_t k=0; k<readers[insn.dst].size(); ++k)
+	{
+	  int j = readers[insn.dst][k];
+	  if (j != i)
+	  {
+	    succ[j].push_back(std::make_pair(i, 0));
+	    npred[i]++;
+	  }
+	}
+	lastWrite[insn.dst] = i;
+	readers[insn.dst].clear();
+      }
+
+      // the latency from each step to the end of the block
+      std::vector<int> height(n);
+      for (int i=n; i--;)
+      {
+	height[i] = Latency(body[i], u);
+	for (size_t k=0; k<succ[i].size(); ++k)
+	  height[i] = std::max(height[i], succ[i][k].second + height[succ[i][k].first]);
+      }
+
+      std::vector<int> earliest(n, 0);
+      std::vector<bool> done(n, false);
+      std::vector<Insn> order;
+      for (int cycle=0; (int) order.size() < n; ++cycle)
+      {
+	int issued = 0, rots = 0;
+	while (issued < u.width)
+	{
+	  int best = -1;
+	  for (int i=0; i<n; ++i)
+	  {
+	    if (done[i] || npred[i] > 0 || earliest[i] > cycle)
+	      continue;
+	    if (body[i].op == OP_ROT && rots == u.rotPorts)
+	      continue;
+	    if (best < 0 || height[i] > height[best])
+	      best = i;
+	  }
+	  if (best < 0)
+	    break;
+	  done[best] = true;
+	  order.push_back(body[best]);
+	  issued++;
+	  rots += (body[best].op == OP_ROT);
+	  for (size_t k=0; k<succ[best].size(); ++k)
+	  {
+	    int j = succ[best][k].first;
+	    npred[j]--;
+	    earliest[j] = std::max(earliest[j], cycle + succ[best][k].second);
+	  }
+	}
+      }
+      body.swap(order);
+    }
+
+    void CodegenForward(Sieve const& p, const int *shifts)
+    {
+      for (int iIter=0; iIter < p._iters; ++iIter)
+      {
+	for (int iVar=0; iVar <vars; ++iVar)
+	{
+	  Feed((OP_e) p._op[0], iVar);
+	  for (int iOp=1; iOp < _ops; ++iOp)
+	  {
+	    Op((OP_e) p._op[iOp],
+	       (p._v1[iOp] + iVar) % vars,
+	       (p._v2[iOp] + iVar) % vars,
+	       shifts, iVar);
+	  }
+	}
+      }
+    }
+
+    void CodegenBackward(Sieve const& p, const int *shifts)
+    {
+      for (int iIter=p._iters; iIter--;)
+      {
+	for (int iVar=vars; iVar--;)
+	{
+	  // the data is not being added symmetrically, but the goal is to test all deltas,
+	  // not test them in the reverse order that they were tested forwards.
+	  RFeed((OP_e) p._op[0], (iVar + 1) % vars, vars - iVar - 1);
+	  for (int iOp=_ops; --iOp;)
+	  {
+	    ROp((OP_e) p._op[iOp],
+		(p._v1[iOp] + iVar) % vars,
+		(p._v2[iOp] + iVar) % vars,
+		shifts, iVar);
+	  }
+	}
+      }
+    }
+
+    // For the profilers, e.g. mix42_fwd3_x8 is the forward mix starting
+    // at var 3 of candidate 42 for 8 lanes, and mix_fwd0_stream the one
+    // that times a function being reported.  With perfMap, all of the
+    // candidates are mix_fwd3_x8.
+    std::string Name(int64_t index, bool stream) const
+    {
+      char buf[64];
+      snprintf(buf, sizeof buf, "mix%s_%s%d_", index >= 0 ? std::to_string(index).c_str() : "",
+	       forward ? "fwd" : "bwd", start);
+      if (stream)
+	return std::string(buf) + "stream";
+      return std::string(buf) + "x" + std::to_string(lanes);
+    }
+
+  public:
+    // With an arena, the function becomes callable once the arena
+    // is sealed.  A stream function is scalar, and mixes consecutive
+    // blocks of data into the same state, see Stream(); it can
+    // prefetch the data so many bytes ahead of each block.  A patchable
+    // function can take other shift constants, see Retune().
+    JitMixFunc(Sieve const& p, bool forward, int start, struct jit_arena *arena = NULL,
+	       bool stream = false, bool patchable = false, int prefetch = 0)
+    {
+      this->forward = forward;
+      this->start = start;
+      this->patchable = patchable;
+      // The state and the block count are kept in registers
+      // alongside the vars.  AVX2 needs a spare vector register.
+      vars = p._vars;
+      lanes = stream ? 1 : p._lanes;
+      unroll = p._unroll;
+      if (lanes == 1)
+	nregs = JR_ARG2;
+      else
+	nregs = (lanes == 4) ? JV15 : JV15 + 1;
+      if (forward)
+	CodegenForward(p, p._s + start);
+      else
+	CodegenBackward(p, p._s + start);
+      if (vars <= nregs)
+	Schedule(*p._uarch);
+      regOf.assign(vars, -1);
+      varIn.assign(nregs, -1);
+      dirty.assign(vars, false);
+
+      jit = arena ? jit_new_arena(arena) : jit_new();
+      jit_name(jit, Name(perfMap ? -1 : p._index, stream).c_str());
+      if (lanes > 1)
+	jit_vsetup(jit, lanes);
+      bool resident = stream && vars <= nregs;
+      if (resident)
+	Unpack();
+      int loop = jit_label(jit);
+      jit_bind(jit, loop);
+      for (int iBlock=0; iBlock<unroll; ++iBlock)
+      {
+	for (int i=0; stream && prefetch && i<8*vars; i+=64)
+	  jins_PREFETCH(jit, JINS_MEM(JR_ARG1, prefetch + i));
+	if (vars <= nregs)
+	  EmitDirect(!resident);
+	else
+	  EmitSpilled(!stream || iBlock == unroll-1);
+	if (!stream)
+	  jins_ADDi(jit, JR_ARG0, 8*lanes*vars);
+	jins_ADDi(jit, JR_ARG1, 8*lanes*vars);
+      }
+      jins_LOOP(jit, JR_ARG2, loop);
+      if (resident)
+	Bundle();
+      func = (func_t) jit_compile(jit);
+    }
+
+    ~JitMixFunc()
+    {
+      jit_free(jit);
+    }
+
+    // Patch in the shift constants of p, which differs from the
+    // structure the function was compiled for only in those.  The code
+    // must be writable (see jit_patch()).
+    void Retune(Sieve const& p)
+    {
+      assert(patchable);
+      for (size_t i=0; i<patches.size(); ++i)
+      {
+	const Insn& insn = body[patches[i].second];
+	jit_patch(jit, patches[i].first, Param(forward, p._s[start + insn.shift]));
+      }
+    }
+
+    // Mix n independent blocks in one call.  The batch is processed
+    // in whole granules, see below.
+    void Batch(uint64_t *state, const uint64_t *data, size_t n)
+    {
+      assert(n > 0);
+      size_t granule = lanes * unroll;
+      func(state, data, (n + granule - 1) / granule);
+    }
+
+    // Mix n consecutive blocks of data into the state, with a stream
+    // function.
+    void Stream(uint64_t *state, const uint64_t *data, size_t n)
+    {
+      assert(lanes == 1 && n % unroll == 0);
+      func(state, data, n / unroll);
+    }
+
+    // Where the i-th block of a batch starts; its vars are lanes apart.
+    // The blocks past n in the last granule (vector lanes times unrolled
+    // blocks) get mixed too, and are then ignored; see Pad().
+    int Lanes() const
+    {
+      return lanes;
+    }
+    int Granule() const
+    {
+      return lanes * unroll;
+    }
+    uint64_t *Block(uint64_t *batch, int i) const
+    {
+      return batch + (i / lanes) * lanes * vars + i % lanes;
+    }
+
+    // Zero the blocks past n in the last granule, so that the Mix
+    // reads no indeterminate values there.
+    void Pad(uint64_t *state, uint64_t *data, int n) const
+    {
+      for (int i=n; i % Granule(); ++i)
+	for (int iVar=0; iVar<vars; ++iVar)
+	  Block(state, i)[iVar*lanes] = Block(data, i)[iVar*lanes] = 0;
+    }
+  };
+
+  // The forward and backward Mix for every start, compiled in one go,
+  // and patched with the shift constants of the next candidate of the
+  // same structure.
+  class MixSet
+  {
+    JitMixFunc *mix[2][_maxVars];
+    int vars;
+
+  public:
+    MixSet(Sieve const& p, struct jit_arena *arena)
+    {
+      vars = p._vars;
+      for (int iVar=0; iVar<vars; ++iVar)
+      {
+	mix[1][iVar] = new JitMixFunc(p, 1, iVar, arena, false, p._patchable);
+	mix[0][iVar] = new JitMixFunc(p, 0, iVar, arena, false, p._patchable);
+      }
+    }
+
+    void Retune(Sieve const& p)
+    {
+      for (int iVar=0; iVar<vars; ++iVar)
+      {
+	mix[1][iVar]->Retune(p);
+	mix[0][iVar]->Retune(p);
+      }
+    }
+
+    ~MixSet()
+    {
+      for (int iVar=0; iVar<vars; ++iVar)
+      {
+	delete mix[1][iVar];
+	delete mix[0][iVar];
+      }
+    }
+
+    JitMixFunc& operator()(bool forward, int start)
+    {
+      return *mix[forward][start];
+    }
+  };
+
+  FILE *_fp;       // output file pointer
+  FILE *_log;      // diagnostics
+  int _vars;       // words of state
+  int _lanes;      // 1 for the scalar Mix, or the vector width
+  int _unroll;     // blocks per trip through the Mix loop
+  int _iters;      // rounds of mixing per block
+  Counter::func_t _count;  // measures and popcounts for OneTest()
+  int _biasTrials;         // see SetBias()
+  Bias::func_t _biasAdd;
+  std::vector<size_t> _streamSizes;  // see SetStream()
+  int _prefetch;
+  Buffer *_buffer;         // for Throughput(), or NULL until needed
+  Bench _bench;    // times the candidates that pass
+  Bench::Sample _speed;    // median run of Speed()
+  double _cyclesPerByte;
+  bool _showSpeed; // see SetShowSpeed()
+  double _cyclesPerBlock;
+  int _minVal;     // of the last candidate to pass
+  Front *_front;   // in the Pareto mode
+  const Uarch *_uarch;     // what Predict() models
+  bool _dominated; // the last candidate fell behind the front
+  int _failCounter;        // the count that failed the last candidate
+  int _failCell;           // and where, see FailCell()
+  std::shared_ptr<const std::vector<int> > _order;  // see SetOrder()
+  std::map<int, std::vector<uint32_t> > _pairs;      // by step, see Pairs()
+  std::vector<Stage> _cascade;  // screens before the full Test()
+  int _rejected;   // where the last candidate failed
+  struct jit_arena *_arena;  // code for the candidate being tested
+  Stats _stats;              // since the last TakeStats()
+  MixSet *_mix;              // in the arena, or NULL
+  std::vector<int> _mixShape;  // what _mix was compiled for, see Shape()
+  bool _patchable;           // see SetPatchable()
+  Random _r;       // random number generator
+  int64_t _index;  // of the candidate, see Seed(), or -1
+
+  int _op[_ops];   // what type of operation (values in 0..3)
+  int _v1[_ops];   // which variable first (values in 0..VAR-1)
+  int _v2[_ops];   // which variable next (values in 0..VAR-1)
+  int _s[2*_maxVars]; // shift constant (values 0..63)
+};
+
+
+// Verdicts of the structures tested so far, by Sieve::Key(): minVal
+// if passed, or -1-stage if rejected.  It can be saved, to skip the
+// structures already tested by other runs; the fingerprint says which
+// settings the verdicts depend on.
+class Cache
+{
+public:
+  bool Find(uint64_t key, int& verdict)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::unordered_map<uint64_t, int32_t>::const_iterator it = _map.find(key);
+    if (it == _map.end())
+      return false;
+    verdict = it->second;
+    return true;
+  }
+
+  void Add(uint64_t key, int verdict)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _map[key] = verdict;
+  }
+
+  void Write(FILE *f)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    uint64_t n = _map.size();
+    fwrite(&n, sizeof n, 1, f);
+    for (std::unordered_map<uint64_t, int32_t>::const_iterator it = _map.begin(); it != _map.end(); ++it)
+    {
+      fwrite(&it->first, sizeof it->first, 1, f);
+      fwrite(&it->second, sizeof it->second, 1, f);
+    }
+  }
+
+  bool Read(FILE *f)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    uint64_t n;
+    if (fread(&n, sizeof n, 1, f) != 1)
+      return false;
+    _map.clear();
+    _map.reserve(n);
+    for (uint64_t i=0; i<n; ++i)
+    {
+      uint64_t key;
+      int32_t verdict;
+      if (fread(&key, sizeof key, 1, f) != 1 || fread(&verdict, sizeof verdict, 1, f) != 1)
+	return false;
+      _map[key] = verdict;
+    }
+    return true;
+  }
+
+  // a file of its own, replaced atomically
+  bool Save(const char *path, const std::string& fingerprint)
+  {
+    std::string tmp = std::string(path) + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (f == NULL)
+      return false;
+    fwrite(_magic, sizeof _magic, 1, f);
+    uint32_t len = fingerprint.size();
+    fwrite(&len, sizeof len, 1, f);
+    fwrite(fingerprint.data(), len, 1, f);
+    Write(f);
+    return fflush(f) == 0 && fsync(fileno(f)) == 0 && fclose(f) == 0 &&
+      rename(tmp.c_str(), path) == 0;
+  }
+
+  // A missing file is fine: there is nothing cached yet.
+  bool Load(const char *path, const std::string& fingerprint)
+  {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+      return true;
+    char magic[sizeof _magic];
+    uint32_t len;
+    bool ok = fread(magic, sizeof magic, 1, f) == 1 && memcmp(magic, _magic, sizeof magic) == 0 &&
+      fread(&len, sizeof len, 1, f) == 1;
+    std::string fp(ok ? len : 0, 0);
+    ok = ok && (len == 0 || fread(&fp[0], len, 1, f) == 1) && fp == fingerprint && Read(f);
+    fclose(f);
+    return ok;
+  }
+
+  size_t Size()
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _map.size();
+  }
+
+private:
+  static const char _magic[8];
+  std::mutex _mutex;
+  std::unordered_map<uint64_t, int32_t> _map;
+};
+
+const char Cache::_magic[8] = { 'S', 'I', 'E', 'V', 'E', 'C', 'A', '1' };
+
+
+// run parameters
+struct Config
+{
+  uint64_t seed;
+  int minGood;     // stop after this many functions pass
+  int maxBad;      // or after this many fail
+  int threads;     // number of worker threads
+  int vars;        // words of state
+  int lanes;       // 1 for scalar Mix, or vector lanes
+  int unroll;      // blocks per trip through the Mix loop
+  int iters;       // rounds of mixing per block
+  Counter::func_t count;  // popcount kernel
+  int biasTrials;  // for the avalanche matrix of the survivors, or 0
+  Bias::func_t biasAdd;
+  std::vector<size_t> streamSizes;  // to time the functions reported over, or none
+  int prefetch;    // bytes ahead, or 0
+  bool showSpeed;  // report the measured speed of the survivors
+  bool pareto;     // report only the Pareto front
+  const Uarch *uarch;      // for the predictions
+  std::vector<Sieve::Stage> cascade;
+  std::vector<std::string> stageNames;
+  int rotations;   // enumerate the structures, with so many rotation sets each, or 0
+  uint64_t first, last;    // the range of the enumeration
+  int steps;       // anneal chains of so many steps, or 0
+  std::vector<std::string> from;  // where the chains start, in turn
+  const char *cache;       // verdicts of the structures seen before, or NULL
+  const char *checkpoint;  // where to save the progress, or NULL
+  int checkpointEvery;     // seconds between the checkpoints
+  bool resume;     // from the checkpoint
+  const char *stats;       // where to append the stats, or NULL
+  int statsEvery;  // seconds between them
+};
+
+// Set by SIGTERM or SIGINT: save a checkpoint and quit.
+static volatile sig_atomic_t stopRequested;
+
+static void requestStop(int sig)
+{
+  (void) sig;
+  stopRequested = 1;
+}
+
+// Set by SIGUSR1: dump the stats now.
+static volatile sig_atomic_t statsRequested;
+
+static void requestStats(int sig)
+{
+  (void) sig;
+  statsRequested = 1;
+}
+
+// The outcome of testing one candidate, held until it can be reported
+// in the same order as a single-threaded run would report it.
+struct Verdict
+{
+  Sieve::Structure st;
+  int pass;
+  int rejected;    // see Sieve::Rejected()
+  bool dominated;  // see Sieve::Dominated()
+  int minVal;      // if passed
+  double cycles;   // per block, if passed
+  uint64_t key;    // see Sieve::Key()
+  bool cached;     // not tested, seen before
+  int fullTests;   // how many candidates a chain took to the full Test()
+  int failCell;    // see Sieve::FailCell(), -1 if not tested
+  char *log;       // diagnostics printed while testing
+  size_t logLen;
+};
+
+// Candidates are numbered, and candidate i is always generated and
+// tested from the same random stream, no matter which worker picks it.
+// Workers run ahead of the reporter by a bounded window; the reporter
+// takes verdicts strictly in order and stops as soon as a single-threaded
+// run would stop.  Verdicts past the stopping point are discarded.
+class Driver
+{
+public:
+  Driver(const Config& cfg, FILE *fp)
+    : _cfg(cfg), _fp(fp), _issued(0), _next(0), _stop(false), _paused(false),
+      _good(0), _bad(0), _dominated(0), _cached(0), _fullTests(0), _quiet(NULL)
+  {
+    _window = 64 * cfg.threads;
+    _tested.assign(cfg.cascade.size() + 1, 0);
+    _rejected.assign(cfg.cascade.size() + 1, 0);
+    _cellFails.assign(64 * cfg.vars, 0);
+    if (cfg.rotations) {
+      Sieve sieve(cfg.seed, fp);
+      sieve.SetVars(cfg.vars);
+      _structures = sieve.Enumerate();
+      _passes.assign(_structures.size(), 0);
+      _last = std::min(cfg.last, (uint64_t) _structures.size() * cfg.rotations);
+      _next = std::min(cfg.first, _last);
+    }
+  }
+
+  // Returns false if stopped by a signal, with the progress saved.
+  bool Run()
+  {
+    Sieve reporter(_cfg.seed, _fp);
+    reporter.SetVars(_cfg.vars);
+    reporter.SetUnroll(_cfg.unroll);
+    reporter.SetIters(_cfg.iters);
+    reporter.SetUarch(_cfg.uarch);
+    reporter.SetStream(_cfg.streamSizes, _cfg.prefetch);
+    if (_cfg.resume)
+      Restore();
+    else {
+      if (_cfg.cache && !_cache.Load(_cfg.cache, CacheFingerprint())) {
+	fprintf(stderr, "%s: not a cache for these settings\n", _cfg.cache);
+	exit(1);
+      }
+      reporter.Pre();
+      // the presets to compare with, before the workers compete
+      if (!_cfg.streamSizes.empty() && _cfg.vars == 12)
+      {
+	static const char *presets[] = { "spooky", "alpha", "akron" };
+	static const Sieve::stream_t compiled[] = {
+	  mix::Mix<mix::Spooky>::Stream, mix::Mix<mix::Alpha>::Stream, mix::Mix<mix::Akron>::Stream,
+	};
+	for (int i = 0; i < 3; i++) {
+	  reporter.Preload(presets[i]);
+	  reporter.Throughput(presets[i], _cfg.iters == 1 ? compiled[i] : NULL);
+	}
+      }
+    }
+    _issued = _next;
+    if (_cfg.steps && !(_quiet = fopen("/dev/null", "w"))) {
+      perror("/dev/null");
+      exit(1);
+    }
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < _cfg.threads; i++)
+      workers.emplace_back(&Driver::Worker, this);
+
+    time_t lastSaved = time(NULL);
+    time_t lastStats = time(NULL);
+    _startTime = std::chrono::steady_clock::now();
+    _startNext = _next;
+    bool stopped = false;
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (More()) {
+      if (_cfg.checkpoint && stopRequested) {
+	stopped = true;
+	break;
+      }
+      if (statsRequested || (_cfg.stats && time(NULL) - lastStats >= _cfg.statsEvery)) {
+	statsRequested = 0;
+	DumpStats();
+	lastStats = time(NULL);
+      }
+      std::map<uint64_t, Verdict>::iterator it = _done.find(_next);
+      if (it == _done.end()) {
+	_doneCV.wait_for(lock, std::chrono::seconds(1));
+	continue;
+      }
+      Verdict v = it->second;
+      _done.erase(it);
+      Learn(v);
+      _next++;
+      if ((_next - Origin()) % _epoch == 0)
+	Snapshot();
+      _issueCV.notify_all();
+      lock.unlock();
+
+      // The cache only changes here, in order, so whether a candidate
+      // was seen before does not depend on how the workers raced.
+      int verdict;
+      if (_cfg.steps) {
+	// a chain reports the best candidate it found
+	fwrite(v.log, 1, v.logLen, _fp);
+	free(v.log);
+	_fullTests += v.fullTests;
+	if (v.pass)
+	  Report(reporter, v.st);
+	else
+	  _bad++;
+      }
+      else if (_cfg.cache && _cache.Find(v.key, verdict)) {
+	free(v.log);
+	if (verdict >= 0)
+	  fprintf(_fp, "// seen before: minVal = %d\n", verdict);
+	else
+	  fprintf(_fp, "// seen before: rejected by %s\n", StageName(-1 - verdict));
+	_cached++;
+	_bad++;
+	lock.lock();
+	continue;
+      }
+      else {
+	assert(!v.cached);
+	if (_cfg.cache && !v.dominated)
+	  _cache.Add(v.key, v.pass ? v.minVal : -1 - v.rejected);
+
+	fwrite(v.log, 1, v.logLen, _fp);
+	free(v.log);
+	CountStages(v);
+	if (v.pass && _cfg.pareto) {
+	  _good++;
+	  Front::Entry e = { v.minVal, v.cycles, _next - 1 };
+	  if (_front.Add(e))
+	    _frontSt[e.index] = v.st;
+	}
+	else if (v.pass)
+	  Report(reporter, v.st);
+	else
+	  _bad++;
+	if (v.pass && _cfg.rotations)
+	  _passes[(_next - 1) / _cfg.rotations]++;
+	_dominated += v.dominated;
+      }
+
+      if (_cfg.checkpoint && time(NULL) - lastSaved >= _cfg.checkpointEvery) {
+	Save();
+	lastSaved = time(NULL);
+      }
+      lock.lock();
     }
+    _stop = true;
+    _issueCV.notify_all();
+    lock.unlock();
+
+    for (size_t i = 0; i < workers.size(); i++)
+      workers[i].join();
+    if (_quiet)
+      fclose(_quiet);
+    for (std::map<uint64_t, Verdict>::iterator it = _done.begin(); it != _done.end(); ++it)
+      free(it->second.log);
+    if (_cfg.stats)
+      DumpStats();
+
+    // A resumed run that has nothing left to do ends the same way.
+    if (_cfg.checkpoint)
+      Save();
+    if (_cfg.cache && !_cache.Save(_cfg.cache, CacheFingerprint()))
+      perror(_cfg.cache);
+    if (stopped)
+      return false;
+
+    int good = _good;
+    if (_cfg.pareto)
+      good = ReportFront(reporter);
+    reporter.Post(good);
+    ReportStages();
+    if (_cfg.steps)
+      fprintf(_fp, "// chains: %d passed, %d failed, %llu full tests\n",
+	      _good, _bad, (unsigned long long) _fullTests);
+    if (_cfg.rotations)
+      ReportStructures();
+    return true;
   }
 
-  void Post(int numFunctions)
+private:
+  // A function that passed.  If it is to be streamed, the workers are
+  // held back meanwhile, so that they do not compete for the core and
+  // the memory.
+  void Report(Sieve& reporter, const Sieve::Structure& st)
   {
-    int i;
-    fprintf(_fp, "\n");
-    fprintf(_fp, "int main(int argc, char **argv)\n");
-    fprintf(_fp, "{\n");
-    fprintf(_fp, "  uint64_t a, state[VAR], data[VAR];\n");
-    fprintf(_fp, "  int i;\n");
-    fprintf(_fp, "  for (int i=0; i<VAR; ++i) state[i] = data[i] = i+argc;\n");
-    for (i=0; i<numFunctions; ++i)
-    {
-      fprintf(_fp, "  wrapper%d(data, state);\n", i);
-    }
-    fprintf(_fp, "}\n");
-    fprintf(_fp, "\n");
+    bool pause = !_cfg.streamSizes.empty();
+    if (pause)
+      Pause();
+    reporter.Load(st);
+    reporter.ReportCode(_good++);
+    if (pause)
+      Resume();
   }
 
+  // Stop issuing candidates, and wait for those in flight.
+  void Pause()
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _paused = true;
+    while (_issued - _next > _done.size())
+      _doneCV.wait(lock);
+  }
 
-private:
+  void Resume()
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _paused = false;
+    _issueCV.notify_all();
+  }
 
-  // print operation
-  static void inline PrintOp(FILE *fp, int k, int x, int y, int s)
+  void CountStages(const Verdict& v)
   {
-    switch (k) {
-    case OP_ADD: fprintf(fp, "    s%d += s%d;", x, y); break;
-    case OP_SUB: fprintf(fp, "    s%d -= s%d;", x, y); break;
-    case OP_XOR: fprintf(fp, "    s%d ^= s%d;", x, y); break;
-    default: assert(k == OP_ROT);
-      if (s == 0 || s == 64)
-	fprintf(fp, "    s%d = Bswap64(s%d);", x, x);
-      else
-	fprintf(fp, "    s%d = Rot64(s%d, %d);", x, x, s);
-    }
+    size_t n = v.pass ? _tested.size() : v.rejected + 1;
+    for (size_t i = 0; i < n; i++)
+      _tested[i]++;
+    if (!v.pass)
+      _rejected[v.rejected]++;
   }
 
-  class JitMixFunc;
+  // OneTest() learns which pairs fail most often, from the verdicts in
+  // the order they are reported, and tests those first.  So that every
+  // candidate is tested the same way however the workers race, the
+  // order changes only from one epoch of candidates to the next:
+  // those of epoch e (counting from the first candidate) go in the
+  // order learned from the candidates before epoch e - 1.  The verdicts
+  // do not depend on the order anyway, only the "// fail" lines.
+  static const uint64_t _epoch = 512;
 
-  int OneTest(JitMixFunc& Mix)
+  uint64_t Origin() const
   {
-    static const int _measures = 10;  // number of different ways of looking
-    static const int _trials = 3;     // number of pairs of hashes
-    static const int _limit =3*64;    // minimum number of bits affected
-    uint64_t a[_measures][_vars];
-    int minVal = _vars*64;
+    return _cfg.rotations ? std::min(_cfg.first, _last) : 0;
+  }
 
-    // iBit covers just key[0], because that is the variable we start at
-    for (int iBit=0; iBit<64; ++iBit)
-    {  
-      for (int iBit2=iBit; iBit2<_vars*64; ++iBit2)
-      {  
-	uint64_t total[_measures][_vars] = {};  // accumulated affect per bit
-	for (int iTrial=0; iTrial<_trials; ++iTrial)
-	{
-	  // test one pair of inputs
-	  uint64_t data[_vars] = {};
-	  for (int iVar=0; iVar<_vars; ++iVar)
-	  {
-	    uint64_t value = _r.Value();
-	    // if (1 || iVar != goose) value = 0;  // hack
-	    a[0][iVar] = value;  // input/output of first of pair
-	    a[1][iVar] = value;  // input/output of second of pair
-	  }
-	  
-	  // evaluate first of pair
-	  Mix(a[0], data);
-	  
-	  // evaluate second of pair, differing in one bit
-	  data[iBit/64] ^= (((uint64_t)1) << (iBit & 63));
-	  if (iBit2 != iBit)
-	  {
-	    data[iBit2/64] ^= (((uint64_t)1) << (iBit2 & 63));
-	  }
-	  Mix(a[1], data);
-	  
-	  for (int iVar=0; iVar<_vars; ++iVar)
-	  {
-	    a[2][iVar] = a[0][iVar] ^ a[1][iVar];  // xor of first and second
-	    a[3][iVar] = a[0][iVar] - a[1][iVar];
-	    a[3][iVar] ^= a[3][iVar]>>1;   // "-" of first and second, graycoded
-	    a[4][iVar] = a[0][iVar] + a[1][iVar];
-	    a[4][iVar] ^= a[4][iVar]>>1;   // "+" of first and second, graycoded
-	    a[5][iVar] = ~a[0][iVar];      // a[5..9] are complements of a[0..4]
-	    a[6][iVar] = ~a[1][iVar];         
-	    a[7][iVar] = ~a[2][iVar];
-	    a[8][iVar] = ~a[3][iVar];
-	    a[9][iVar] = ~a[4][iVar];
-	  }
-	  for (int iMeasure=0; iMeasure<_measures; ++iMeasure)
-	  {
-	    for (int iVar=0; iVar<_vars; ++iVar)
-	    {
-	      total[iMeasure][iVar] |= a[iMeasure][iVar];
-	    }
-	  }
-	}
-	for (int iMeasure=0; iMeasure<_measures; ++iMeasure)
-	{
-	  int counter = 0;
-	  for (int iVar=0; iVar<_vars; ++iVar)
-	  {
-	    counter += Popcnt(total[iMeasure][iVar]);
-	  }
-	  if (counter < _limit)
-	  {
-	    if (1)
-	    {
-	      printf("// fail %d %d %d\n", iMeasure, iBit, counter);
-	    }
-	    return 0;
-	  }
-	  if (counter < minVal)
-	  {
-	    minVal = counter;
-	  }
-	}
+  // The reporter must have got this far before the candidate is tested.
+  uint64_t Learned(uint64_t index) const
+  {
+    uint64_t e = (index - Origin()) / _epoch;
+    return e < 2 ? 0 : Origin() + (e - 1) * _epoch;
+  }
+
+  std::shared_ptr<const std::vector<int> > Order(uint64_t index) const
+  {
+    uint64_t e = (index - Origin()) / _epoch;
+    if (e < 2)
+      return NULL;
+    std::map<uint64_t, std::shared_ptr<const std::vector<int> > >::const_iterator it =
+      _orders.find(e - 1);
+    assert(it != _orders.end());
+    return it->second;
+  }
+
+  void Learn(const Verdict& v)
+  {
+    if (v.failCell >= 0)
+      _cellFails[v.failCell]++;
+  }
+
+  // The cells that failed most often first, at the end of an epoch.
+  // Called with the lock.
+  void Snapshot()
+  {
+    uint64_t e = (_next - Origin()) / _epoch;
+    std::vector<int> *order = new std::vector<int>(_cellFails.size());
+    for (size_t i = 0; i < order->size(); i++)
+      (*order)[i] = i;
+    std::stable_sort(order->begin(), order->end(),
+		     [this](int a, int b) { return _cellFails[a] > _cellFails[b]; });
+    _orders[e].reset(order);
+    // Nobody needs those any more.
+    _orders.erase(_orders.begin(), _orders.lower_bound(e - 1));
+  }
+
+  // Random candidates are drawn until enough of them pass, or fail;
+  // the enumeration goes through its whole range.
+  bool More() const
+  {
+    if (_cfg.rotations)
+      return _next < _last;
+    return _good < _cfg.minGood && _bad < _cfg.maxBad;
+  }
+
+  // How many rotation sets of each structure in the range passed.
+  void ReportStructures()
+  {
+    static const char opc[] = "+-^";
+    uint64_t first = std::min(_cfg.first, _last);
+    for (size_t i = 0; i < _structures.size(); i++) {
+      uint64_t lo = std::max(first, i * _cfg.rotations);
+      uint64_t hi = std::min(_last, (i + 1) * _cfg.rotations);
+      if (lo >= hi)
+	continue;
+      const Sieve::Structure& st = _structures[i];
+      fprintf(_fp, "// structure %zu: s0 %c= data;", i, opc[st.op[0]]);
+      for (int iOp = 1; iOp < 5; iOp++) {
+	if (st.op[iOp] == 3)
+	  fprintf(_fp, " s%d = Rot64(s%d);", st.v1[iOp], st.v1[iOp]);
+	else
+	  fprintf(_fp, " s%d %c= s%d;", st.v1[iOp], opc[st.op[iOp]], st.v2[iOp]);
       }
+      fprintf(_fp, " passed %llu of %llu\n", (unsigned long long) _passes[i],
+	      (unsigned long long) (hi - lo));
     }
-    return minVal;
   }
 
-  class JitMixFunc
+  // What a run must agree on to continue another one's output.
+  // Threads, lanes and such do not change the output.
+  std::string Fingerprint() const
   {
-    struct jit *jit;
-    typedef void (*func_t)(uint64_t *state, const uint64_t *data);
-    func_t func;
+    char buf[256];
+    snprintf(buf, sizeof buf, "seed=%llu pareto=%d cache=%d enum=%d:%llu:%llu bias=%d anneal=%d:",
+	     (unsigned long long) _cfg.seed, _cfg.pareto, _cfg.cache != NULL, _cfg.rotations,
+	     (unsigned long long) _cfg.first, (unsigned long long) _cfg.last, _cfg.biasTrials,
+	     _cfg.steps);
+    std::string fp(buf);
+    for (size_t i = 0; i < _cfg.from.size(); i++)
+      fp += (i ? "," : "") + _cfg.from[i];
+    return fp + " " + CacheFingerprint();
+  }
 
-    // Put the state variables into registers.
-    void Unpack()
-    {
-      for (int iVar=0; iVar <_vars; ++iVar)
-	jins_MOVrm(jit, (JR_e) iVar, JINS_MEM(JR_ARG0, 8*iVar));
-    }
+  // What the verdicts depend on.
+  std::string CacheFingerprint() const
+  {
+    char buf[256];
+    snprintf(buf, sizeof buf, "vars=%d iters=%d uarch=%s cascade=",
+	     _cfg.vars, _cfg.iters, _cfg.uarch->name);
+    std::string fp(buf);
+    for (size_t i = 0; i < _cfg.stageNames.size(); i++)
+      fp += (i ? "," : "") + _cfg.stageNames[i];
+    return fp;
+  }
 
-    // Gather the state back.
-    void Bundle()
-    {
-      for (int iVar=0; iVar <_vars; ++iVar)
-	jins_MOVmr(jit, JINS_MEM(JR_ARG0, 8*iVar), (JR_e) iVar);
+  const char *StageName(size_t i) const
+  {
+    return i < _cfg.cascade.size() ? _cfg.stageNames[i].c_str() : "full";
+  }
+
+  template <class T> static void Put(FILE *f, const T& x)
+  {
+    fwrite(&x, sizeof x, 1, f);
+  }
+  template <class T> void Get(FILE *f, T& x)
+  {
+    if (fread(&x, sizeof x, 1, f) != 1)
+      Corrupt();
+  }
+  void Corrupt()
+  {
+    fprintf(stderr, "%s: truncated checkpoint\n", _cfg.checkpoint);
+    exit(1);
+  }
+
+  // Everything it takes to go on from the next candidate: the output
+  // so far (up to its length), the counters, and the front.  Workers
+  // draw each candidate from its own stream, so there is no random
+  // state to save.  The output is synced first, and the checkpoint
+  // replaced atomically, so that a crash at any point leaves a
+  // consistent pair behind.
+  void Save()
+  {
+    fflush(_fp);
+    fsync(fileno(_fp));
+    uint64_t offset = ftell(_fp);
+
+    std::string tmp = std::string(_cfg.checkpoint) + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (f == NULL) {
+      perror(tmp.c_str());
+      exit(1);
+    }
+    fwrite(_magic, sizeof _magic, 1, f);
+    std::string fp = Fingerprint();
+    Put(f, (uint32_t) fp.size());
+    fwrite(fp.data(), fp.size(), 1, f);
+    Put(f, offset);
+    Put(f, _next);
+    Put(f, _good);
+    Put(f, _bad);
+    Put(f, _dominated);
+    Put(f, _cached);
+    Put(f, _fullTests);
+    for (size_t i = 0; i < _tested.size(); i++) {
+      Put(f, _tested[i]);
+      Put(f, _rejected[i]);
+    }
+    if (_cfg.cache)
+      _cache.Write(f);
+    for (size_t i = 0; i < _passes.size(); i++)
+      Put(f, _passes[i]);
+    std::vector<Front::Entry> front = _front.Get();
+    Put(f, (uint32_t) front.size());
+    for (size_t i = 0; i < front.size(); i++) {
+      Put(f, front[i]);
+      Put(f, _frontSt[front[i].index]);
+    }
+    for (size_t i = 0; i < _cellFails.size(); i++)
+      Put(f, _cellFails[i]);
+    Put(f, (uint32_t) _orders.size());
+    for (std::map<uint64_t, std::shared_ptr<const std::vector<int> > >::iterator it = _orders.begin();
+	 it != _orders.end(); ++it) {
+      Put(f, it->first);
+      for (size_t i = 0; i < it->second->size(); i++)
+	Put(f, (*it->second)[i]);
     }
+    if (fflush(f) || fsync(fileno(f)) || fclose(f) ||
+	rename(tmp.c_str(), _cfg.checkpoint)) {
+      perror(_cfg.checkpoint);
+      exit(1);
+    }
+  }
 
-    // Trickle-feed some data into the state: sX ?= data[X]
-    void Feed(OP_e op, int iVar)
-    {
-      switch (op) {
-      case OP_ADD: jins_ADDrm(jit, (JR_e) iVar, JINS_MEM(JR_ARG1, 8*iVar)); break;
-      case OP_SUB: jins_SUBrm(jit, (JR_e) iVar, JINS_MEM(JR_ARG1, 8*iVar)); break;
-      case OP_XOR: jins_XORrm(jit, (JR_e) iVar, JINS_MEM(JR_ARG1, 8*iVar)); break;
-      default: assert(0);
+  void Restore()
+  {
+    FILE *f = fopen(_cfg.checkpoint, "rb");
+    if (f == NULL) {
+      perror(_cfg.checkpoint);
+      exit(1);
+    }
+    char magic[sizeof _magic];
+    if (fread(magic, sizeof magic, 1, f) != 1 || memcmp(magic, _magic, sizeof magic)) {
+      fprintf(stderr, "%s: not a checkpoint\n", _cfg.checkpoint);
+      exit(1);
+    }
+    uint32_t len;
+    Get(f, len);
+    std::string fp(len, 0);
+    if (len && fread(&fp[0], len, 1, f) != 1)
+      Corrupt();
+    if (fp != Fingerprint()) {
+      fprintf(stderr, "%s: saved by a different run: %s\n", _cfg.checkpoint, fp.c_str());
+      exit(1);
+    }
+    uint64_t offset;
+    Get(f, offset);
+    Get(f, _next);
+    Get(f, _good);
+    Get(f, _bad);
+    Get(f, _dominated);
+    Get(f, _cached);
+    Get(f, _fullTests);
+    for (size_t i = 0; i < _tested.size(); i++) {
+      Get(f, _tested[i]);
+      Get(f, _rejected[i]);
+    }
+    if (_cfg.cache && !_cache.Read(f))
+      Corrupt();
+    for (size_t i = 0; i < _passes.size(); i++)
+      Get(f, _passes[i]);
+    uint32_t n;
+    Get(f, n);
+    for (uint32_t i = 0; i < n; i++) {
+      Front::Entry e;
+      Get(f, e);
+      Get(f, _frontSt[e.index]);
+      _front.Add(e);
+    }
+    for (size_t i = 0; i < _cellFails.size(); i++)
+      Get(f, _cellFails[i]);
+    Get(f, n);
+    for (uint32_t i = 0; i < n; i++) {
+      uint64_t e;
+      Get(f, e);
+      std::vector<int> *order = new std::vector<int>(_cellFails.size());
+      for (size_t j = 0; j < order->size(); j++) {
+	Get(f, (*order)[j]);
+	if ((size_t) (*order)[j] >= order->size())
+	  Corrupt();
       }
+      _orders[e].reset(order);
     }
+    fclose(f);
 
-    // In the reverse direction, not symmetric (see below)
-    void RFeed(OP_e op, int iState, int iData)
-    {
-      switch (op) {
-      case OP_ADD: jins_SUBrm(jit, (JR_e) iState, JINS_MEM(JR_ARG1, 8*iData)); break;
-      case OP_SUB: jins_ADDrm(jit, (JR_e) iState, JINS_MEM(JR_ARG1, 8*iData)); break;
-      case OP_XOR: jins_XORrm(jit, (JR_e) iState, JINS_MEM(JR_ARG1, 8*iData)); break;
-      default: assert(0);
-      }
+    // Drop whatever was written after the checkpoint.
+    fflush(_fp);
+    if (fseek(_fp, 0, SEEK_END) || (uint64_t) ftell(_fp) < offset) {
+      fprintf(stderr, "%s: the output is shorter than the checkpoint says\n", _cfg.checkpoint);
+      exit(1);
+    }
+    if (ftruncate(fileno(_fp), offset) || fseek(_fp, offset, SEEK_SET)) {
+      perror("ftruncate");
+      exit(1);
     }
+  }
 
-    // A mixing step: sX ?= sY, or possibly sX = permute(sX, param)
-    void Op(OP_e op, JR_e dst, JR_e src, int param)
+  // Print the functions on the front, the fastest first; returns how many.
+  int ReportFront(Sieve& reporter)
+  {
+    std::vector<Front::Entry> front = _front.Get();
+    for (size_t i = 0; i < front.size(); i++)
     {
-      switch (op) {
-      case OP_ADD: jins_ADD(jit, dst, src); break;
-      case OP_SUB: jins_SUB(jit, dst, src); break;
-      case OP_XOR: jins_XOR(jit, dst, src); break;
-      default: assert(op == OP_ROT);
-	if (param % 64 == 0)
-	  jins_BSWAP(jit, dst);
-	else
-	  jins_ROTL(jit, dst, param);
-      }
+      fprintf(_fp, "// front: candidate %llu, minVal = %d, %.1f cycles/block\n",
+	      (unsigned long long) front[i].index, front[i].minVal, front[i].cycles);
+      reporter.Load(_frontSt[front[i].index]);
+      reporter.ReportCode(i);
     }
+    return front.size();
+  }
 
-    void ROp(OP_e op, JR_e dst, JR_e src, int param)
-    {
-      switch (op) {
-      case OP_ADD: jins_SUB(jit, dst, src); break;
-      case OP_SUB: jins_ADD(jit, dst, src); break;
-      case OP_XOR: jins_XOR(jit, dst, src); break;
-      default: assert(op == OP_ROT);
-	if (param % 64 == 0)
-	  jins_BSWAP(jit, dst);
-	else
-	  jins_ROTL(jit, dst, 64 - param);
-      }
+  // Seconds to go at the current rate, or -1 if there is no telling.
+  double Eta(double elapsed) const
+  {
+    double done = _next - _startNext;
+    if (done == 0)
+      return -1;
+    if (_cfg.rotations)
+      return (_last - _next) * elapsed / done;
+    // whichever of MINGOOD and MAXBAD comes first
+    double eta = -1;
+    if (_good > 0)
+      eta = (_cfg.minGood - _good) * elapsed / _good;
+    if (_bad > 0) {
+      double bad = (_cfg.maxBad - _bad) * elapsed / _bad;
+      if (eta < 0 || bad < eta)
+	eta = bad;
     }
+    return eta;
+  }
 
-    void CodegenForward(Sieve const& p, const int *shifts)
+  // One line of JSON, to the stats file, or to stderr if there is none
+  // (on SIGUSR1).  The stats cover this run, since the resume if any;
+  // the phases are timed in Stats::Clock() units.  Called with the lock.
+  void DumpStats()
+  {
+    FILE *f = _cfg.stats ? fopen(_cfg.stats, "a") : stderr;
+    if (f == NULL) {
+      perror(_cfg.stats);
+      return;
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - _startTime).count();
+    uint64_t done = _next - _startNext;
+    fprintf(f, "{\"time\": %lld, \"elapsed\": %.3f, \"next\": %llu, \"reported\": %llu, "
+	    "\"good\": %d, \"bad\": %d, \"cached\": %llu, \"rate\": %.3f, \"eta\": ",
+	    (long long) time(NULL), elapsed, (unsigned long long) _next,
+	    (unsigned long long) done, _good, _bad, (unsigned long long) _cached,
+	    elapsed > 0 ? done / elapsed : 0.0);
+    double eta = Eta(elapsed);
+    if (eta < 0)
+      fprintf(f, "null");
+    else
+      fprintf(f, "%.0f", eta);
+    fprintf(f, ", \"clock\": \"%s\", \"phases\": {", Stats::Clock());
+    for (int i = 0; i < Stats::PHASES; i++)
+      fprintf(f, "%s\"%s\": {\"calls\": %llu, \"ticks\": %llu}", i ? ", " : "", Stats::Name(i),
+	      (unsigned long long) _stats.calls[i], (unsigned long long) _stats.ticks[i]);
+    fprintf(f, "}, \"stages\": [");
+    for (size_t i = 0; i < _tested.size(); i++)
+      fprintf(f, "%s{\"name\": \"%s\", \"tested\": %llu, \"rejected\": %llu}", i ? ", " : "",
+	      StageName(i), (unsigned long long) _tested[i], (unsigned long long) _rejected[i]);
+    // the failures by measure, by iBit, and both, [measure][iBit]
+    fprintf(f, "], \"fail_measure\": [");
+    for (int i = 0; i < Stats::_measures; i++) {
+      uint64_t n = 0;
+      for (int j = 0; j < 64; j++)
+	n += _stats.fail[i][j];
+      fprintf(f, "%s%llu", i ? ", " : "", (unsigned long long) n);
+    }
+    fprintf(f, "], \"fail_bit\": [");
+    for (int j = 0; j < 64; j++) {
+      uint64_t n = 0;
+      for (int i = 0; i < Stats::_measures; i++)
+	n += _stats.fail[i][j];
+      fprintf(f, "%s%llu", j ? ", " : "", (unsigned long long) n);
+    }
+    fprintf(f, "], \"fail\": [");
+    for (int i = 0; i < Stats::_measures; i++) {
+      fprintf(f, "%s[", i ? ", " : "");
+      for (int j = 0; j < 64; j++)
+	fprintf(f, "%s%llu", j ? ", " : "", (unsigned long long) _stats.fail[i][j]);
+      fprintf(f, "]");
+    }
+    fprintf(f, "]}\n");
+    if (f == stderr)
+      fflush(f);
+    else
+      fclose(f);
+  }
+
+  // how well the cascade works for the candidates we generate
+  void ReportStages()
+  {
+    for (size_t i = 0; i < _tested.size() && !_cfg.steps; i++)
     {
-      for (int iIter=0; iIter < _iters; ++iIter)
+      fprintf(_fp, "// stage %s: tested %llu, rejected %llu\n", StageName(i),
+	      (unsigned long long) _tested[i], (unsigned long long) _rejected[i]);
+    }
+    if (_cfg.pareto)
+      fprintf(_fp, "// dominated during the full test: %llu\n", (unsigned long long) _dominated);
+    if (_cfg.cache)
+      fprintf(_fp, "// seen before: %llu\n", (unsigned long long) _cached);
+  }
+
+  // One chain of simulated annealing: mutate the candidate, test it,
+  // and take the change if it is fitter, or else with a probability
+  // that falls off with how much less fit it is, and with the
+  // temperature, which goes down from step to step.  The chain draws
+  // from its own streams, and remembers the fitness of the structures
+  // it has already tested, so it always comes out the same.  Its
+  // verdict is that of the fittest candidate it came across.
+  void Anneal(Sieve& sieve, uint64_t chain, Verdict& v)
+  {
+    static const double T0 = 64, T1 = 1;
+    FILE *log = sieve.Log();
+    sieve.SetLog(_quiet);
+    sieve.Seed(_cfg.seed, chain);
+    Random r;
+    r.Init(_cfg.seed ^ ~(chain * 0x9e3779b97f4a7c15ULL));
+
+    const std::string& from = _cfg.from[chain % _cfg.from.size()];
+    if (!sieve.Preload(from))
+      sieve.Generate();
+    Sieve::Structure cur, best;
+    std::unordered_map<uint64_t, int> seen;
+    int fCur = -1, fBest = -1;
+    v.fullTests = 0;
+    v.minVal = 0;
+    v.cycles = 0;
+    for (int step = 0; step <= _cfg.steps; step++) {
+      uint64_t key;
       {
-	for (int iVar=0; iVar <_vars; ++iVar)
-	{
-	  Feed((OP_e) p._op[0], iVar);
-	  for (int iOp=1; iOp < _ops; ++iOp)
-	  {
-	    Op((OP_e) p._op[iOp],
-	       (JR_e)((p._v1[iOp] + iVar) % p._vars),
-	       (JR_e)((p._v2[iOp] + iVar) % p._vars),
-	       shifts[iVar]);
-	  }
+	Stats::Timer timer(sieve.GetStats(), Stats::GENERATE);
+	if (step > 0) {
+	  sieve.Load(cur);
+	  sieve.Mutate();
 	}
+	key = sieve.Key();
+      }
+      int f;
+      std::unordered_map<uint64_t, int>::iterator it = seen.find(key);
+      if (it != seen.end())
+	f = it->second;
+      else {
+	int pass = sieve.Test();
+	f = seen[key] = sieve.Fitness();
+	v.fullTests += pass || sieve.Rejected() == (int) _cfg.cascade.size();
+	if (f > fBest) {
+	  sieve.Save(best);
+	  fBest = f;
+	  v.pass = pass;
+	  v.rejected = sieve.Rejected();
+	  v.minVal = pass ? sieve.MinVal() : 0;
+	  v.cycles = pass ? sieve.CyclesPerBlock() : 0;
+	  v.key = key;
+	  fprintf(log, "// chain %llu from %s, step %d: fitness %d%s\n",
+		  (unsigned long long) chain, from.c_str(), step, f, pass ? ", passed" : "");
+	}
+      }
+      double T = T0 * pow(T1 / T0, (double) step / _cfg.steps);
+      if (f >= fCur || (double) r.Value() / 18446744073709551616.0 < exp((f - fCur) / T)) {
+	sieve.Save(cur);
+	fCur = f;
       }
     }
+    if (v.pass)
+      fprintf(log, "// minVal = %d\n", v.minVal);
+    v.st = best;
+    v.dominated = false;
+    v.cached = false;
+    sieve.SetLog(log);
+  }
 
-    void CodegenBackward(Sieve const& p, const int *shifts)
-    {
-      for (int iIter=_iters; iIter--;)
+  void Worker()
+  {
+    Sieve sieve(_cfg.seed, _fp);
+    sieve.SetVars(_cfg.vars);
+    sieve.SetLanes(_cfg.lanes);
+    sieve.SetUnroll(_cfg.unroll);
+    sieve.SetIters(_cfg.iters);
+    sieve.SetCounter(_cfg.count);
+    sieve.SetBias(_cfg.biasTrials, _cfg.biasAdd);
+    sieve.SetShowSpeed(_cfg.showSpeed || _cfg.pareto);
+    sieve.SetCascade(_cfg.cascade);
+    sieve.SetUarch(_cfg.uarch);
+    sieve.SetPatchable(_cfg.rotations || _cfg.steps);
+    if (_cfg.pareto)
+      sieve.SetFront(&_front);
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    for (;;) {
+      while (!_stop && (_paused || _issued >= _next + _window ||
+			(_cfg.rotations && _issued >= _last) ||
+			_next < Learned(_issued)))
+	_issueCV.wait(lock);
+      if (_stop)
+	break;
+      uint64_t index = _issued++;
+      sieve.SetOrder(Order(index));
+      lock.unlock();
+
+      Verdict v;
+      v.failCell = -1;
+      FILE *log = open_memstream(&v.log, &v.logLen);
+      assert(log);
+      sieve.SetLog(log);
+      if (_cfg.steps) {
+	Anneal(sieve, index, v);
+	fclose(log);
+	lock.lock();
+	sieve.TakeStats(_stats);
+	_done[index] = v;
+	_doneCV.notify_one();
+	continue;
+      }
+      int verdict;
       {
-	for (int iVar=_vars; iVar--;)
-	{
-	  // the data is not being added symmetrically, but the goal is to test all deltas,
-	  // not test them in the reverse order that they were tested forwards.
-	  RFeed((OP_e) p._op[0], (iVar + 1) % _vars, _vars - iVar - 1);
-	  for (int iOp=_ops; --iOp;)
-	  {
-	    ROp((OP_e) p._op[iOp],
-		(JR_e)((p._v1[iOp] + iVar) % _vars),
-		(JR_e)((p._v2[iOp] + iVar) % _vars),
-		shifts[iVar]);
-	  }
+	Stats::Timer timer(sieve.GetStats(), Stats::GENERATE);
+	sieve.Seed(_cfg.seed, index);
+	if (_cfg.rotations) {
+	  sieve.Load(_structures[index / _cfg.rotations]);
+	  sieve.Rotate();
 	}
+	else
+	  sieve.Generate();
+	sieve.Save(v.st);
+	v.key = sieve.Key();
       }
-    }
+      v.cached = _cfg.cache && _cache.Find(v.key, verdict);
+      v.pass = v.rejected = v.minVal = 0;
+      v.dominated = false;
+      v.cycles = 0;
+      if (!v.cached) {
+	v.pass = sieve.Test();
+	v.rejected = sieve.Rejected();
+	v.dominated = v.pass ? false : sieve.Dominated();
+	v.minVal = v.pass ? sieve.MinVal() : 0;
+	v.cycles = v.pass ? sieve.CyclesPerBlock() : 0;
+	v.failCell = sieve.FailCell();
+      }
+      fclose(log);
 
-  public:
-    JitMixFunc(Sieve const& p, bool forward, int start)
-    {
-      jit = jit_new();
-      Unpack();
-      if (forward)
-	CodegenForward(p, p._s + start);
-      else
-	CodegenBackward(p, p._s + start);
-      Bundle();
-      func = (func_t) jit_compile(jit);
+      lock.lock();
+      sieve.TakeStats(_stats);
+      _done[index] = v;
+      _doneCV.notify_one();
     }
+  }
 
-    ~JitMixFunc()
-    {
-      jit_free(jit);
-    }
+  const Config _cfg;
+  FILE *_fp;
+  uint64_t _window;  // how far workers may run ahead of the reporter
 
-    void operator()(uint64_t *state, const uint64_t *data)
-    {
-      func(state, data);
-    }
-  };
+  std::mutex _mutex;
+  std::condition_variable _issueCV;  // workers wait for the window to move
+  std::condition_variable _doneCV;   // the reporter waits for verdicts
+  uint64_t _issued;  // next candidate to hand out
+  uint64_t _next;    // next candidate to report
+  bool _stop;
+  bool _paused;      // see Pause()
+  std::map<uint64_t, Verdict> _done;
 
-  static const int _vars = 12;
-  static const int _ops = 5;
-  static const int _iters = 1;
+  // what has been reported so far
+  int _good;
+  int _bad;
 
-  FILE *_fp;       // output file pointer
-  Random _r;       // random number generator
+  // per stage of the cascade, and the full Test() last
+  std::vector<uint64_t> _tested;
+  std::vector<uint64_t> _rejected;
+  uint64_t _dominated;
+  uint64_t _cached;
+  uint64_t _fullTests;     // in the chains
+  FILE *_quiet;            // where the chains log their steps
 
-  int _op[_ops];   // what type of operation (values in 0..3)
-  int _v1[_ops];   // which variable first (values in 0..VAR-1)
-  int _v2[_ops];   // which variable next (values in 0..VAR-1)
-  int _s[2*_vars]; // shift constant (values 0..63)
+  // what OneTest() has learned, see Order(): fails by cell,
+  // and the orders of the recent epochs
+  std::vector<uint64_t> _cellFails;
+  std::map<uint64_t, std::shared_ptr<const std::vector<int> > > _orders;
+
+  // from the workers, see DumpStats()
+  Stats _stats;
+  std::chrono::steady_clock::time_point _startTime;
+  uint64_t _startNext;
+
+  // verdicts by Sieve::Key()
+  Cache _cache;
+
+  // the enumeration: its structures, how many rotation sets of each
+  // passed, and the end of its range
+  std::vector<Sieve::Structure> _structures;
+  std::vector<uint64_t> _passes;
+  uint64_t _last;
+
+  static const char _magic[8];
+
+  // Pareto mode: the front so far, and the structures on it
+  Front _front;
+  std::map<uint64_t, Sieve::Structure> _frontSt;
 };
 
-  
-void driver(uint64_t seed, FILE *fp, int minGood, int maxBad)
+const char Driver::_magic[8] = { 'S', 'I', 'E', 'V', 'E', 'C', 'K', '2' };
+
+// Returns false if stopped by a signal.
+bool driver(const Config& cfg, FILE *fp)
 {
-  Sieve sieve(seed, fp);
+  Driver d(cfg, fp);
+  return d.Run();
+}
+
+static void usage(const char *argv0)
+{
+  fprintf(stderr, "Usage: %s [-j THREADS] [-v VARS] [-l LANES] [-u UNROLL] [-i ITERS] [-c CASCADE] [-p POPCNT] [-P] [-t] [-a UARCH] [-b TRIALS]\n"
+		  "       [-e ROTATIONS [--range FIRST:LAST]]\n"
+		  "       [-s STEPS [--from spooky,alpha,akron,random]] [--stats FILE [--stats-every SECONDS]]\n"
+		  "       [--stream SIZES [--prefetch BYTES]] [--perf map|dump|map,dump]\n"
+		  "       [-o OUTPUT] [--cache FILE] [--checkpoint FILE [--resume] [--checkpoint-every SECONDS]] [MINGOOD [MAXBAD]]\n", argv0);
+  fprintf(stderr, "CASCADE is a comma-separated list of screens, each of them\n"
+		  "single, sampleN or all, optionally followed by :fwd; or none.\n"
+		  "It may start with predictN, to reject the candidates predicted\n"
+		  "to take more than N cycles per block, before any testing.\n"
+		  "POPCNT is scalar, avx2 or avx512; the best available by default.\n"
+		  "-b works out the full avalanche matrix of each candidate that passes,\n"
+		  "over so many trials, and reports its worst bias and chi-square.\n"
+		  "-P reports only the Pareto front of minVal vs. speed.\n"
+		  "-t reports the measured speed of each function that passes, as -P\n"
+		  "does; the output then differs from run to run.\n"
+		  "UARCH is skylake, icelake, zen2 or zen4, for the predictions.\n"
+		  "A checkpoint is saved every minute, and on SIGTERM or SIGINT,\n"
+		  "from which --resume goes on with the same OUTPUT file.\n"
+		  "The --cache FILE keeps the verdicts across runs, so that the\n"
+		  "structures equivalent to those seen before are not tested again.\n"
+		  "-e goes through every structure of ops, with so many random sets\n"
+		  "of the rotation constants each; candidate i is structure i / ROTATIONS.\n"
+		  "The range of candidates is [FIRST, LAST), all of them by default;\n"
+		  "MINGOOD and MAXBAD do not apply.\n"
+		  "-s runs chains of simulated annealing instead of testing random\n"
+		  "candidates, each of them starting from the next one of --from,\n"
+		  "and reporting the best candidate it finds; MINGOOD and MAXBAD\n"
+		  "count the chains.\n"
+		  "--stats appends a line of JSON to FILE every 10 seconds, with where\n"
+		  "the time goes, where the candidates fail, and how long there is to go;\n"
+		  "SIGUSR1 asks for one at once, on stderr if there is no FILE.\n"
+		  "--stream times each function reported, and the presets, hashing\n"
+		  "messages of each of SIZES (e.g. 4K,256K,8M,1G) in memory mapped\n"
+		  "on huge pages where it can be, and reports GB/s; the presets also\n"
+		  "as compiled by the C++ compiler (see mix.h), to compare with.\n"
+		  "--prefetch has the JIT'd loop prefetch the data so many bytes ahead.\n"
+		  "--perf names the compiled functions for perf, in /tmp/perf-PID.map\n"
+		  "for perf report, or with the code in /tmp/jit-PID.dump for\n"
+		  "perf record -k mono, then perf inject --jit and perf annotate.\n"
+		  "The map grows by 2*VARS lines per candidate, and names them all\n"
+		  "alike, as they share addresses; --perf dump keeps them apart.\n");
+  exit(2);
+}
 
-  sieve.Pre();
+// e.g. "single,sample16:fwd"
+static bool parseCascade(const char *spec, Config& cfg)
+{
+  cfg.cascade.clear();
+  cfg.stageNames.clear();
+  if (strcmp(spec, "none") == 0)
+    return true;
+  std::string list(spec);
+  size_t pos = 0;
+  while (pos <= list.size()) {
+    size_t comma = list.find(',', pos);
+    if (comma == std::string::npos)
+      comma = list.size();
+    std::string name = list.substr(pos, comma - pos);
+    pos = comma + 1;
 
-  for (int good = 0, bad = 0; good < minGood && bad < maxBad; ) {
-    sieve.Generate();
-    if (sieve.Test())
-      sieve.ReportCode(good++);
+    Sieve::Stage stage;
+    std::string pairs = name;
+    stage.forward = false;
+    stage.budget = 0;
+    if (name.compare(0, 7, "predict") == 0) {
+      // before the sweeps, which need code
+      if (!cfg.cascade.empty() && cfg.cascade.back().budget == 0)
+	return false;
+      stage.step = 0;
+      stage.budget = atof(name.c_str() + 7);
+      if (stage.budget <= 0)
+	return false;
+      cfg.cascade.push_back(stage);
+      cfg.stageNames.push_back(name);
+      continue;
+    }
+    size_t colon = name.find(':');
+    if (colon != std::string::npos) {
+      if (name.substr(colon) != ":fwd")
+	return false;
+      stage.forward = true;
+      pairs = name.substr(0, colon);
+    }
+    if (pairs == "single")
+      stage.step = 0;
+    else if (pairs == "all")
+      stage.step = 1;
+    else if (pairs.compare(0, 6, "sample") == 0) {
+      stage.step = atoi(pairs.c_str() + 6);
+      if (stage.step < 1)
+	return false;
+    }
     else
-      bad++;
+      return false;
+    cfg.cascade.push_back(stage);
+    cfg.stageNames.push_back(name);
   }
-
-  sieve.Post(minGood);
+  return true;
 }
 
 int main(int argc, char **argv)
 {
+  Config cfg;
+  cfg.seed = 21;
+  cfg.threads = 1;
+  cfg.vars = 12;
+  cfg.lanes = std::max(1, jit_vlanes());
+  cfg.unroll = 1;
+  cfg.iters = 1;
+  cfg.count = Counter::Select(NULL);
+  cfg.biasTrials = 0;
+  cfg.biasAdd = Bias::Select(NULL);
+  cfg.prefetch = 0;
+  cfg.showSpeed = false;
+  cfg.pareto = false;
+  cfg.uarch = Uarch::Find("skylake");
+  cfg.rotations = 0;
+  cfg.steps = 0;
+  cfg.from.push_back("spooky");
+  cfg.from.push_back("alpha");
+  cfg.from.push_back("akron");
+  cfg.first = 0;
+  cfg.last = UINT64_MAX;
+  cfg.cache = NULL;
+  cfg.checkpoint = NULL;
+  cfg.checkpointEvery = 60;
+  cfg.resume = false;
+  cfg.stats = NULL;
+  cfg.statsEvery = 10;
+  parseCascade("single,sample16:fwd", cfg);
+  const char *output = NULL;
+  int perf = 0;
+
+  enum { OPT_CHECKPOINT = 256, OPT_RESUME, OPT_EVERY, OPT_CACHE, OPT_RANGE, OPT_FROM, OPT_STATS, OPT_STATS_EVERY,
+	 OPT_STREAM, OPT_PREFETCH, OPT_PERF };
+  static const struct option longopts[] = {
+    { "checkpoint", required_argument, NULL, OPT_CHECKPOINT },
+    { "resume", no_argument, NULL, OPT_RESUME },
+    { "checkpoint-every", required_argument, NULL, OPT_EVERY },
+    { "cache", required_argument, NULL, OPT_CACHE },
+    { "range", required_argument, NULL, OPT_RANGE },
+    { "from", required_argument, NULL, OPT_FROM },
+    { "stats", required_argument, NULL, OPT_STATS },
+    { "stats-every", required_argument, NULL, OPT_STATS_EVERY },
+    { "stream", required_argument, NULL, OPT_STREAM },
+    { "prefetch", required_argument, NULL, OPT_PREFETCH },
+    { "perf", required_argument, NULL, OPT_PERF },
+    { NULL, 0, NULL, 0 },
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "j:v:l:u:i:c:p:Pta:o:e:s:b:", longopts, NULL)) != -1) {
+    switch (opt) {
+    case 'o':
+      output = optarg;
+      break;
+    case OPT_CHECKPOINT:
+      cfg.checkpoint = optarg;
+      break;
+    case 'e':
+      cfg.rotations = atoi(optarg);
+      if (cfg.rotations < 1)
+	usage(argv[0]);
+      break;
+    case OPT_RANGE: {
+      unsigned long long first, last;
+      if (sscanf(optarg, "%llu:%llu", &first, &last) != 2 || first > last)
+	usage(argv[0]);
+      cfg.first = first;
+      cfg.last = last;
+      break;
+    }
+    case 's':
+      cfg.steps = atoi(optarg);
+      if (cfg.steps < 1)
+	usage(argv[0]);
+      break;
+    case OPT_FROM: {
+      cfg.from.clear();
+      std::string list(optarg);
+      for (size_t pos = 0; pos <= list.size(); ) {
+	size_t comma = std::min(list.find(',', pos), list.size());
+	std::string name = list.substr(pos, comma - pos);
+	if (name != "spooky" && name != "alpha" && name != "akron" && name != "random")
+	  usage(argv[0]);
+	cfg.from.push_back(name);
+	pos = comma + 1;
+      }
+      break;
+    }
+    case OPT_CACHE:
+      cfg.cache = optarg;
+      break;
+    case OPT_STATS:
+      cfg.stats = optarg;
+      break;
+    case OPT_STATS_EVERY:
+      cfg.statsEvery = atoi(optarg);
+      if (cfg.statsEvery < 1)
+	usage(argv[0]);
+      break;
+    case OPT_STREAM: {
+      cfg.streamSizes.clear();
+      for (const char *p = optarg; ; p++) {
+	char *end;
+	unsigned long long size = strtoull(p, &end, 10);
+	int shift = 0;
+	switch (*end) {
+	case 'G': shift += 10;  // fall through
+	case 'M': shift += 10;  // fall through
+	case 'K': shift += 10;
+	  end++;
+	}
+	if (end == p || size == 0 || (*end != ',' && *end != '\0'))
+	  usage(argv[0]);
+	cfg.streamSizes.push_back((size_t) size << shift);
+	p = end;
+	if (*p == '\0')
+	  break;
+      }
+      break;
+    }
+    case OPT_PREFETCH:
+      cfg.prefetch = atoi(optarg);
+      if (cfg.prefetch < 0)
+	usage(argv[0]);
+      break;
+    case OPT_PERF:
+      if (strcmp(optarg, "map") == 0)
+	perf = JIT_PERF_MAP;
+      else if (strcmp(optarg, "dump") == 0)
+	perf = JIT_PERF_DUMP;
+      else if (strcmp(optarg, "map,dump") == 0 || strcmp(optarg, "dump,map") == 0)
+	perf = JIT_PERF_MAP | JIT_PERF_DUMP;
+      else
+	usage(argv[0]);
+      break;
+    case OPT_RESUME:
+      cfg.resume = true;
+      break;
+    case OPT_EVERY:
+      cfg.checkpointEvery = atoi(optarg);
+      if (cfg.checkpointEvery < 0)
+	usage(argv[0]);
+      break;
+    case 'j':
+      // -j0 means all CPUs
+      cfg.threads = atoi(optarg);
+      if (cfg.threads == 0)
+	cfg.threads = std::max(1u, std::thread::hardware_concurrency());
+      if (cfg.threads < 1)
+	usage(argv[0]);
+      break;
+    case 'v':
+      // registers are spilled as needed
+      cfg.vars = atoi(optarg);
+      if (cfg.vars < 4 || cfg.vars > 32)
+	usage(argv[0]);
+      break;
+    case 'l':
+      // -l1 selects the scalar code
+      cfg.lanes = atoi(optarg);
+      if (cfg.lanes != 1 && cfg.lanes != 4 && cfg.lanes != 8)
+	usage(argv[0]);
+      if (cfg.lanes > std::max(1, jit_vlanes())) {
+	fprintf(stderr, "%s: this CPU cannot do %d lanes\n", argv[0], cfg.lanes);
+	exit(1);
+      }
+      break;
+    case 'u':
+      // OneTest's batch must be a whole number of granules
+      cfg.unroll = atoi(optarg);
+      if (cfg.unroll != 1 && cfg.unroll != 2 && cfg.unroll != 4 && cfg.unroll != 8)
+	usage(argv[0]);
+      break;
+    case 'i':
+      cfg.iters = atoi(optarg);
+      if (cfg.iters < 1)
+	usage(argv[0]);
+      break;
+    case 'c':
+      if (!parseCascade(optarg, cfg))
+	usage(argv[0]);
+      break;
+    case 'a':
+      cfg.uarch = Uarch::Find(optarg);
+      if (cfg.uarch == NULL)
+	usage(argv[0]);
+      break;
+    case 'P':
+      cfg.pareto = true;
+      break;
+    case 't':
+      cfg.showSpeed = true;
+      break;
+    case 'b':
+      cfg.biasTrials = atoi(optarg);
+      if (cfg.biasTrials < 1)
+	usage(argv[0]);
+      break;
+    case 'p':
+      cfg.count = Counter::Select(optarg);
+      cfg.biasAdd = Bias::Select(optarg);
+      if (cfg.count == NULL || cfg.biasAdd == NULL) {
+	fprintf(stderr, "%s: this CPU cannot do %s\n", argv[0], optarg);
+	exit(1);
+      }
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+
   int n = 3, N = n * 99;
   if (argc > 1) {
     n = atoi(argv[1]);
@@ -621,5 +4098,47 @@ int main(int argc, char **argv)
       assert(N >= n);
     }
   }
-  driver(21, stdout, n);
+  cfg.minGood = n;
+  cfg.maxBad = N;
+
+  if (cfg.steps && (cfg.rotations || cfg.pareto)) {
+    fprintf(stderr, "%s: -s does not go with -e or -P\n", argv[0]);
+    exit(2);
+  }
+  // The presets are for 12 vars.
+  if (cfg.steps && cfg.vars != 12 &&
+      std::count(cfg.from.begin(), cfg.from.end(), "random") != (long) cfg.from.size()) {
+    fprintf(stderr, "%s: the presets need 12 vars, use --from random\n", argv[0]);
+    exit(2);
+  }
+
+  // The checkpoint records how much of the output is done, so it
+  // must be a file.
+  if ((cfg.checkpoint || cfg.resume) && (!cfg.checkpoint || !output)) {
+    fprintf(stderr, "%s: a checkpoint needs both --checkpoint and -o\n", argv[0]);
+    exit(2);
+  }
+  FILE *fp = stdout;
+  if (output) {
+    fp = fopen(output, cfg.resume ? "r+" : "w");
+    if (fp == NULL) {
+      perror(output);
+      exit(1);
+    }
+  }
+  if (cfg.checkpoint) {
+    signal(SIGTERM, requestStop);
+    signal(SIGINT, requestStop);
+  }
+  signal(SIGUSR1, requestStats);
+  perfMap = perf & JIT_PERF_MAP;
+  if (perf && jit_perf_open(perf) < 0) {
+    perror("jit_perf_open");
+    exit(1);
+  }
+  bool done = driver(cfg, fp);
+  jit_perf_close();
+  if (fp != stdout)
+    fclose(fp);
+  return done ? 0 : 3;
 }
@@ -21,7 +21,10 @@
 #undef NDEBUG
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 #include <assert.h>
+#include <unistd.h>
 #include "jit.h"
 
 #define TEST_OP(JOP, COP)				\
@@ -121,6 +124,387 @@ static void test_XORswap(void)
     jit_free(jit);
 }
 
+static void test_loop(void)
+{
+    // Sum an array, advancing the pointer.
+    struct jit *jit = jit_new();
+    jins_XOR(jit, JR0, JR0);
+    int top = jit_label(jit);
+    jit_bind(jit, top);
+    jins_ADDrm(jit, JR0, JINS_MEM0(JR_ARG0));
+    jins_ADDi(jit, JR_ARG0, 8);
+    jins_LOOP(jit, JR_ARG1, top);
+    uint64_t (*sum)(const uint64_t *a, uint64_t n) =
+	jit_compile(jit);
+    uint64_t a[300], s = 0;
+    int n = 1 + random() % 300;
+    for (int i = 0; i < n; i++)
+	s += a[i] = random();
+    assert(sum(a, n) == s);
+    jit_free(jit);
+}
+
+static void test_branch(void)
+{
+    // Return a - b if they differ, otherwise all ones.
+    struct jit *jit = jit_new();
+    int same = jit_label(jit);
+    int done = jit_label(jit);
+    jins_MOV(jit, JR0, JR_ARG0);
+    jins_CMP(jit, JR_ARG0, JR_ARG1);
+    jins_JZ(jit, same);
+    jins_SUB(jit, JR0, JR_ARG1);
+    jins_JMP(jit, done);
+    jit_bind(jit, same);
+    jins_XOR(jit, JR0, JR0);
+    jins_SUBi(jit, JR0, 1);
+    jit_bind(jit, done);
+    uint64_t (*func)(uint64_t a, uint64_t b) =
+	jit_compile(jit);
+    uint64_t a = random(), b = random() | 1;
+    assert(func(a, a) == ~(uint64_t) 0);
+    assert(func(a, b) == (a == b ? ~(uint64_t) 0 : a - b));
+    assert(func(a, a + 1000) == (uint64_t) -1000);
+    jit_free(jit);
+}
+
+// Vector ops are checked lane by lane against the scalar ones.
+// The operands are placed at an offset, to exercise the displacement.
+#define TEST_VOP(lanes, JOP, COP, disp)				\
+do {								\
+    struct jit *jit = jit_new();				\
+    jit_vsetup(jit, lanes);					\
+    jins_VMOVrm(jit, JV9, JINS_MEM(JR_ARG0, disp));		\
+    jins_VMOVrm(jit, JV2, JINS_MEM(JR_ARG1, disp));		\
+    jins_V##JOP(jit, JV9, JV2);					\
+    jins_V##JOP##rm(jit, JV2, JINS_MEM(JR_ARG0, disp));	\
+    jins_VMOVmr(jit, JINS_MEM(JR_ARG0, disp), JV9);		\
+    jins_VMOVmr(jit, JINS_MEM(JR_ARG1, disp), JV2);		\
+    void (*func)(uint64_t *a, uint64_t *b) =			\
+	jit_compile(jit);					\
+    uint64_t a[128], b[128], a0[8], b0[8];			\
+    for (int i = 0; i < lanes; i++) {				\
+	a[disp/8+i] = a0[i] = random() << 33 ^ random();	\
+	b[disp/8+i] = b0[i] = random() << 33 ^ random();	\
+    }								\
+    func(a, b);							\
+    for (int i = 0; i < lanes; i++) {				\
+	assert(a[disp/8+i] == (a0[i] COP b0[i]));		\
+	assert(b[disp/8+i] == (b0[i] COP a0[i]));		\
+    }								\
+    jit_free(jit);						\
+} while (0)
+
+#define TEST_VOPr(lanes, JOP, reg, ...)				\
+do {								\
+    struct jit *jit = jit_new();				\
+    jit_vsetup(jit, lanes);					\
+    jins_VMOVrm(jit, reg, JINS_MEM0(JR_ARG0));			\
+    jins_V##JOP(jit, reg, ##__VA_ARGS__);			\
+    jins_VMOVmr(jit, JINS_MEM(JR_ARG0, 8*lanes), reg);		\
+    void (*func)(uint64_t *x) =					\
+	jit_compile(jit);					\
+    uint64_t x[16];						\
+    for (int i = 0; i < lanes; i++)				\
+	x[i] = random() << 33 ^ random();			\
+    func(x);							\
+    for (int i = 0; i < lanes; i++)				\
+	assert(x[lanes+i] == COP_##JOP(x[i], ##__VA_ARGS__));	\
+    jit_free(jit);						\
+} while (0)
+
+static void test_vector(int lanes)
+{
+    TEST_VOP(lanes, ADD, +, 0);
+    TEST_VOP(lanes, SUB, -, 64);
+    TEST_VOP(lanes, XOR, ^, 512);
+    int s = 1 + random() % 63;
+    TEST_VOPr(lanes, ROTL, JV3, s);
+    TEST_VOPr(lanes, ROTL, JV12, s);
+    TEST_VOPr(lanes, BSWAP, JV0);
+    TEST_VOPr(lanes, BSWAP, JV13);
+}
+
+static void test_arena(void)
+{
+    // Enough functions to fill more than one chunk.
+    enum { n = 5000 };
+    static uint64_t (*add[n])(uint64_t x);
+    struct jit_arena *arena = jit_arena_new();
+    for (int pass = 0; pass < 2; pass++) {
+	for (int i = 0; i < n; i++) {
+	    struct jit *jit = jit_new_arena(arena);
+	    jins_MOV(jit, JR0, JR_ARG0);
+	    jins_ADDi(jit, JR0, i + pass);
+	    add[i] = jit_compile(jit);
+	    jit_free(jit);
+	}
+	jit_arena_seal(arena);
+	uint64_t x = random();
+	for (int i = 0; i < n; i++)
+	    assert(add[i](x) == x + i + pass);
+	jit_arena_reset(arena);
+    }
+    jit_arena_free(arena);
+}
+
+// Every base register, with disp8 and disp32.
+static void test_disp(void)
+{
+    static const int disps[] = { 0, 8, -8, 120, 128, 4000, -4000 };
+    uint64_t a[1000];
+    for (int i = 0; i < 1000; i++)
+	a[i] = random();
+    for (int base = JR0; base <= JR14; base++)
+	for (size_t i = 0; i < sizeof disps / sizeof *disps; i++) {
+	    int disp = disps[i];
+	    struct jit *jit = jit_new();
+	    jins_MOV(jit, base, JR_ARG0);
+	    jins_MOVrm(jit, JR0, JINS_MEM(base, disp));
+	    jins_MOVmr(jit, JINS_MEM(JR_ARG0, -disp), JR0);
+	    void (*func)(uint64_t *p) = jit_compile(jit);
+	    uint64_t *p = a + 500;
+	    uint64_t x = p[disp/8];
+	    func(p);
+	    assert(p[-disp/8] == x);
+	    jit_free(jit);
+	}
+}
+
+// Prefetch through every base register, including from an address
+// that is not mapped; the loads that follow must still decode.
+static void test_prefetch(void)
+{
+    static const int disps[] = { 0, 64, -64, 4096, -4096 };
+    uint64_t a[1000];
+    for (int i = 0; i < 1000; i++)
+	a[i] = random();
+    for (int base = JR0; base <= JR_SP; base++)
+	for (size_t i = 0; i < sizeof disps / sizeof *disps; i++) {
+	    struct jit *jit = jit_new();
+	    jins_PREFETCH(jit, JINS_MEM(base, disps[i]));
+	    jins_XOR(jit, JR1, JR1);
+	    jins_PREFETCH(jit, JINS_MEM(JR1, disps[i]));
+	    jins_MOVrm(jit, JR0, JINS_MEM(JR_ARG0, 8 * i));
+	    uint64_t (*func)(uint64_t *p) = jit_compile(jit);
+	    assert(func(a + 500) == a[500 + i]);
+	    jit_free(jit);
+	}
+}
+
+// The three-operand and load-op forms, with and without the extensions.
+static void test_isa(int isa)
+{
+    uint64_t a[16];
+    for (int i = 0; i < 16; i++)
+	a[i] = (uint64_t) random() << 32 | random();
+    for (int dst = JR0; dst < JR_ARG2; dst++)
+	for (int src = JR0; src < JR_ARG2; src++) {
+	    struct jit *jit = jit_new();
+	    jit_isa_limit(jit, isa);
+	    jins_MOV(jit, src, JR_ARG0);
+	    jins_MOV(jit, JR_ARG2, JR_ARG1);
+	    jins_ADD3(jit, dst, src, JR_ARG2);
+	    jins_ADD3(jit, dst, dst, src);
+	    jins_MOV(jit, JR0, dst);
+	    uint64_t (*func)(uint64_t x, uint64_t y) = jit_compile(jit);
+	    uint64_t x = a[dst], y = a[src];
+	    assert(func(x, y) == (dst == src ? 2 * (x + y) : 2 * x + y));
+	    jit_free(jit);
+	}
+    // x rotated left and back, and x byte-swapped and rotated left
+    for (int k = 0; k < 64; k++)
+	for (int base = JR0; base <= JR_SP; base += (base == JR9) ? JR_SP - JR9 : 3) {
+	    int dst = (base + 1 + k % 10) % JR_ARG2;
+	    struct jit *jit = jit_new();
+	    jit_isa_limit(jit, isa);
+	    jit_frame(jit, 16);
+	    if (base == JR_SP)
+		jins_MOVmr(jit, JINS_MEM(JR_SP, 8), JR_ARG1);
+	    else
+		jins_MOV(jit, base, JR_ARG0);
+	    jins_ROTLrm(jit, dst, JINS_MEM(base, 8), k);
+	    jins_ROTL3(jit, JR_ARG1, dst, (64 - k) % 64);
+	    jins_BSWAPrm(jit, JR_ARG2, JINS_MEM(base, 8));
+	    jins_ROTL3(jit, JR0, JR_ARG2, k);
+	    jins_XOR(jit, JR0, JR_ARG1);
+	    uint64_t (*func)(uint64_t *p, uint64_t x) = jit_compile(jit);
+	    uint64_t x = a[k % 16];
+	    uint64_t r = __builtin_bswap64(x);
+	    r = k ? r << k | r >> (64 - k) : r;
+	    assert(func(a + k % 16 - 1, x) == (r ^ x));
+	    jit_free(jit);
+	}
+}
+
+// Spill to the stack frame and reload.
+static void test_frame(void)
+{
+    struct jit *jit = jit_new();
+    jit_frame(jit, 1000);
+    for (int i = 0; i < 125; i++) {
+	jins_ADDi(jit, JR_ARG0, i);
+	jins_MOVmr(jit, JINS_MEM(JR_SP, 8 * i), JR_ARG0);
+    }
+    jins_XOR(jit, JR0, JR0);
+    for (int i = 0; i < 125; i++)
+	jins_ADDrm(jit, JR0, JINS_MEM(JR_SP, 8 * i));
+    uint64_t (*func)(uint64_t x) = jit_compile(jit);
+    uint64_t x = random(), y = x, s = 0;
+    for (int i = 0; i < 125; i++)
+	s += y += i;
+    assert(func(x) == s);
+    jit_free(jit);
+}
+
+// A function much larger than a page, with branches across it.
+static void test_big(struct jit_arena *arena)
+{
+    struct jit *jit = arena ? jit_new_arena(arena) : jit_new();
+    int top = jit_label(jit);
+    int skip = jit_label(jit);
+    jins_MOV(jit, JR0, JR_ARG0);
+    jit_bind(jit, top);
+    jins_JMP(jit, skip);
+    for (int i = 0; i < 1000; i++)
+	jins_SUBi(jit, JR0, 1000);
+    jit_bind(jit, skip);
+    for (int i = 0; i < 3000; i++)
+	jins_ADDi(jit, JR0, i);
+    jins_LOOP(jit, JR_ARG1, top);
+    uint64_t (*func)(uint64_t x, uint64_t n) =
+	jit_compile(jit);
+    if (arena)
+	jit_arena_seal(arena);
+    uint64_t x = random(), n = 1 + random() % 10;
+    assert(func(x, n) == x + n * (3000 * 2999 / 2));
+    jit_free(jit);
+    if (arena)
+	jit_arena_reset(arena);
+}
+
+static uint64_t rotl(uint64_t x, int s)
+{
+    return s ? COP_ROTL(x, s) : COP_BSWAP(x);
+}
+
+// Patch the rotations back and forth between ROTL and BSWAP,
+// with two of them in a row, so that a slot that is too short shows.
+static void test_patch(struct jit_arena *arena, int lanes)
+{
+    struct jit *jit = arena ? jit_new_arena(arena) : jit_new();
+    int id[2];
+    if (lanes) {
+	jit_vsetup(jit, lanes);
+	jins_VMOVrm(jit, JV7, JINS_MEM0(JR_ARG0));
+	id[0] = jins_VROTLp(jit, JV7, 0);
+	id[1] = jins_VROTLp(jit, JV7, 5);
+	jins_VMOVmr(jit, JINS_MEM0(JR_ARG0), JV7);
+    }
+    else {
+	jins_MOVrm(jit, JR3, JINS_MEM0(JR_ARG0));
+	id[0] = jins_ROTLp(jit, JR3, 0);
+	id[1] = jins_ROTLp(jit, JR3, 5);
+	jins_MOVmr(jit, JINS_MEM0(JR_ARG0), JR3);
+    }
+    assert(id[0] == 0 && id[1] == 1);
+    void (*func)(uint64_t *x) = jit_compile(jit);
+    int s[2] = { 0, 5 };
+    for (int i = 0; i < 8; i++) {
+	if (i) {
+	    if (arena)
+		jit_arena_unseal(arena);
+	    else
+		jit_unprotect(jit);
+	    s[i & 1] = random() % 3 ? random() % 64 : 0;
+	    jit_patch(jit, id[i & 1], s[i & 1]);
+	    if (arena)
+		jit_arena_seal(arena);
+	    else
+		jit_protect(jit);
+	}
+	else if (arena)
+	    jit_arena_seal(arena);
+	uint64_t x[8];
+	int n = lanes ? lanes : 1;
+	for (int j = 0; j < n; j++)
+	    x[j] = random() << 33 ^ random();
+	uint64_t y = rotl(rotl(x[n-1], s[0]), s[1]);
+	func(x);
+	assert(x[n-1] == y);
+    }
+    jit_free(jit);
+    if (arena)
+	jit_arena_reset(arena);
+}
+
+// A named function and an unnamed one, in an arena, announced to perf:
+// the map has a line for each, and the dump has a record with the code.
+static void test_perf(void)
+{
+#ifdef __linux__
+    assert(jit_perf_open(JIT_PERF_MAP | JIT_PERF_DUMP) == 0);
+    struct jit_arena *arena = jit_arena_new();
+    uint8_t *code[2];
+    for (int i = 0; i < 2; i++) {
+	struct jit *jit = jit_new_arena(arena);
+	if (i == 0)
+	    jit_name(jit, "test_add");
+	jins_MOV(jit, JR0, JR_ARG0);
+	jins_ADDi(jit, JR0, i);
+	code[i] = jit_compile(jit);
+	jit_free(jit);
+    }
+    jit_perf_close();
+
+    char path[64], line[256], name[64];
+    snprintf(path, sizeof path, "/tmp/perf-%d.map", (int) getpid());
+    FILE *fp = fopen(path, "r");
+    assert(fp);
+    for (int i = 0; i < 2; i++) {
+	unsigned long addr, size;
+	assert(fgets(line, sizeof line, fp));
+	assert(sscanf(line, "%lx %lx %63s", &addr, &size, name) == 3);
+	assert((uint8_t *) addr == code[i] && size > 0);
+	if (i == 0)
+	    assert(strcmp(name, "test_add") == 0);
+	else
+	    assert(strncmp(name, "jit_", 4) == 0);
+    }
+    assert(!fgets(line, sizeof line, fp));
+    fclose(fp);
+    unlink(path);
+
+    // the header, two loads, and the close
+    snprintf(path, sizeof path, "/tmp/jit-%d.dump", (int) getpid());
+    fp = fopen(path, "rb");
+    assert(fp);
+    uint32_t h[10];
+    assert(fread(h, sizeof h, 1, fp) == 1);
+    assert(h[0] == 0x4A695444 && h[2] == sizeof h && h[5] == (uint32_t) getpid());
+    for (int i = 0; i < 3; i++) {
+	uint32_t rec[4];
+	assert(fread(rec, sizeof rec, 1, fp) == 1);
+	if (i == 2) {
+	    assert(rec[0] == 3 && rec[1] == sizeof rec);
+	    break;
+	}
+	uint8_t buf[256];
+	assert(rec[0] == 0 && rec[1] <= sizeof rec + sizeof buf);
+	assert(fread(buf, rec[1] - sizeof rec, 1, fp) == 1);
+	uint64_t load[5];  // after pid and tid: vma, addr, size, index
+	memcpy(load, buf, sizeof load);
+	assert((uint8_t *) load[1] == code[i] && load[4] == (uint64_t) i);
+	const char *s = (const char *) buf + sizeof load;
+	assert(i > 0 || strcmp(s, "test_add") == 0);
+	assert(memcmp(s + strlen(s) + 1, code[i], load[3]) == 0);
+    }
+    fclose(fp);
+    unlink(path);
+    jit_arena_free(arena);
+#endif
+}
+
 int main()
 {
     for (int i = 0; i < 9; i++) {
@@ -137,6 +521,34 @@ int main()
 	TEST_OPr(BSWAP);
 	test_swap();
 	test_XORswap();
+	test_disp();
+	test_prefetch();
+	test_isa(0);
+	test_isa(jit_isa());
+	test_frame();
+	test_loop();
+	test_branch();
+	test_arena();
+	test_big(NULL);
+	struct jit_arena *arena = jit_arena_new();
+	test_big(arena);
+	test_big(arena);
+	test_patch(NULL, 0);
+	test_patch(arena, 0);
+	if (jit_vlanes() >= 4) {
+	    test_patch(NULL, 4);
+	    test_patch(arena, 4);
+	}
+	if (jit_vlanes() >= 8) {
+	    test_patch(NULL, 8);
+	    test_patch(arena, 8);
+	}
+	jit_arena_free(arena);
+	if (jit_vlanes() >= 4)
+	    test_vector(4);
+	if (jit_vlanes() >= 8)
+	    test_vector(8);
     }
+    test_perf();
     return 0;
 }